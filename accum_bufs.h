@@ -0,0 +1,405 @@
+/*
+ * Ready-made buffer types for lockfree_accum, sharded_accum and
+ * seqlock_accum (see lockfree_accum.h):
+ *
+ *   lfa_counter        - sum of values
+ *   lfa_counter_vec    - N counters, incremented by index
+ *   lfa_histogram      - fixed-width buckets over [Min, Max)
+ *   lfa_log_histogram  - log-linear (HDR-style) buckets
+ *   lfa_topk           - approximate most frequent keys
+ *
+ * Each buffer is a fixed-size, trivially copyable struct, so copying one
+ * (as lockfree_accum does when accum() finds the valid buffer empty) is
+ * a single memcpy, and accum() is O(1) with no allocation. Each also
+ * implements merge(), as required by sharded_accum and LFA_DELTA. The
+ * histograms and top-K report() the buffer itself, which the reporting
+ * thread can then query.
+ */
+#ifndef ACCUM_BUFS_H
+#define ACCUM_BUFS_H
+
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <type_traits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Adds n counts from src into dst */
+static inline void lfa_add_counts(uint64_t *dst, const uint64_t *src,
+                                  size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= n; i += 4) {
+        auto d = (__m128i *)(dst + i);
+        auto s = (const __m128i *)(src + i);
+        __m128i a = _mm_add_epi64(_mm_loadu_si128(d), _mm_loadu_si128(s));
+        __m128i b =
+            _mm_add_epi64(_mm_loadu_si128(d + 1), _mm_loadu_si128(s + 1));
+        _mm_storeu_si128(d, a);
+        _mm_storeu_si128(d + 1, b);
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] += src[i];
+    }
+}
+
+/*
+ * Returns the bucket holding the value ranked q (0 to 1) among total
+ * values, i.e. the first bucket at which the running count reaches
+ * ceil(q * total). Assumes total > 0.
+ */
+static inline size_t lfa_rank_bucket(const uint64_t *counts, size_t n,
+                                     uint64_t total, double q)
+{
+    q = std::clamp(q, 0.0, 1.0);
+    uint64_t rank = std::max((uint64_t)ceil(q * total), (uint64_t)1);
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < n; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return i;
+        }
+    }
+
+    return n - 1;
+}
+
+/* Sum of all values accumulated */
+template<class T = uint64_t>
+class lfa_counter
+{
+public:
+    void accum(const T &val) { m_sum += val; }
+
+    template<class It>
+    void accum_range(It first, It last)
+    {
+        for (; first != last; ++first) {
+            m_sum += *first;
+        }
+    }
+
+    void merge(const lfa_counter &other) { m_sum += other.m_sum; }
+    const T &report() { return m_sum; }
+    void reset() { m_sum = 0; }
+
+private:
+    T m_sum = 0;
+};
+
+/* N counters, where accum(i) increments counter i */
+template<size_t N>
+class lfa_counter_vec
+{
+public:
+    void accum(const size_t &idx)
+    {
+        assert(idx < N);
+        m_counts[idx]++;
+    }
+
+    void merge(const lfa_counter_vec &other)
+    {
+        lfa_add_counts(m_counts, other.m_counts, N);
+    }
+
+    const lfa_counter_vec &report() { return *this; }
+    void reset() { std::fill_n(m_counts, N, 0); }
+
+    static constexpr size_t size() { return N; }
+    uint64_t operator[](size_t idx) const { return m_counts[idx]; }
+
+    uint64_t total() const
+    {
+        uint64_t total = 0;
+        for (uint64_t count : m_counts) {
+            total += count;
+        }
+        return total;
+    }
+
+private:
+    uint64_t m_counts[N] = {};
+};
+
+/*
+ * Histogram of Buckets equal-width buckets covering [Min, Max). Values
+ * outside the range are counted in the first or last bucket. Since the
+ * bucket width is a compile-time constant, finding the bucket does not
+ * need a hardware divide.
+ */
+template<uint64_t Min, uint64_t Max, size_t Buckets>
+class lfa_histogram
+{
+    static_assert(Max > Min && (Max - Min) % Buckets == 0,
+                  "range must divide evenly into buckets");
+
+public:
+    static constexpr uint64_t width = (Max - Min) / Buckets;
+
+    static constexpr size_t bucket_of(uint64_t val)
+    {
+        val = std::clamp(val, Min, Max - 1);
+        return (val - Min) / width;
+    }
+
+    /* smallest value counted in bucket idx (ignoring clamping) */
+    static constexpr uint64_t bucket_min(size_t idx)
+    {
+        return Min + idx * width;
+    }
+
+    void accum(const uint64_t &val)
+    {
+        m_counts[bucket_of(val)]++;
+        m_total++;
+        m_sum += val;
+    }
+
+    void merge(const lfa_histogram &other)
+    {
+        lfa_add_counts(m_counts, other.m_counts, Buckets);
+        m_total += other.m_total;
+        m_sum += other.m_sum;
+    }
+
+    const lfa_histogram &report() { return *this; }
+
+    void reset()
+    {
+        std::fill_n(m_counts, Buckets, 0);
+        m_total = m_sum = 0;
+    }
+
+    static constexpr size_t size() { return Buckets; }
+    uint64_t operator[](size_t idx) const { return m_counts[idx]; }
+
+    uint64_t total() const { return m_total; }
+    uint64_t sum() const { return m_sum; }
+    double mean() const { return m_total ? (double)m_sum / m_total : 0; }
+
+    /*
+     * Returns the largest value in the bucket holding the value ranked
+     * q (e.g. 0.99 for the 99th percentile), or 0 if empty.
+     */
+    uint64_t quantile(double q) const
+    {
+        if (!m_total) {
+            return 0;
+        }
+        size_t idx = lfa_rank_bucket(m_counts, Buckets, m_total, q);
+        return bucket_min(idx + 1) - 1;
+    }
+
+private:
+    uint64_t m_counts[Buckets] = {};
+    uint64_t m_total = 0;
+    uint64_t m_sum = 0;
+};
+
+/*
+ * Log-linear histogram, similar to HdrHistogram. Values below 2^SubBits
+ * each have their own bucket; above that, each power of two is divided
+ * into 2^SubBits buckets, so a bucket's width is at most 1/2^SubBits of
+ * its smallest value. Values of 2^MaxBits or more are counted in the
+ * last bucket. The defaults (12.5% precision, values up to about 10^12,
+ * e.g. 18 minutes in nanoseconds) need 304 buckets.
+ */
+template<unsigned SubBits = 3, unsigned MaxBits = 40>
+class lfa_log_histogram
+{
+    static_assert(SubBits < MaxBits && MaxBits <= 64, "invalid parameters");
+
+    static constexpr uint64_t sub_count = (uint64_t)1 << SubBits;
+
+public:
+    static constexpr size_t buckets = (MaxBits - SubBits + 1) << SubBits;
+
+    static constexpr size_t bucket_of(uint64_t val)
+    {
+        if (val < sub_count) {
+            return val;
+        }
+        if (MaxBits < 64 && val >> (MaxBits & 63)) {
+            return buckets - 1;
+        }
+
+        unsigned shift = (63 - __builtin_clzll(val)) - SubBits;
+        return ((size_t)(shift + 1) << SubBits) +
+               ((val >> shift) & (sub_count - 1));
+    }
+
+    /* smallest value counted in bucket idx (ignoring clamping) */
+    static constexpr uint64_t bucket_min(size_t idx)
+    {
+        if (idx < sub_count) {
+            return idx;
+        }
+
+        unsigned shift = (idx >> SubBits) - 1;
+        return (sub_count + (idx & (sub_count - 1))) << shift;
+    }
+
+    /* largest value counted in bucket idx (ignoring clamping) */
+    static constexpr uint64_t bucket_max(size_t idx)
+    {
+        if (idx + 1 == buckets && MaxBits == 64) {
+            return UINT64_MAX;
+        }
+        return bucket_min(idx + 1) - 1;
+    }
+
+    void accum(const uint64_t &val)
+    {
+        m_counts[bucket_of(val)]++;
+        m_total++;
+        m_sum += val;
+    }
+
+    void merge(const lfa_log_histogram &other)
+    {
+        lfa_add_counts(m_counts, other.m_counts, buckets);
+        m_total += other.m_total;
+        m_sum += other.m_sum;
+    }
+
+    const lfa_log_histogram &report() { return *this; }
+
+    void reset()
+    {
+        std::fill_n(m_counts, buckets, 0);
+        m_total = m_sum = 0;
+    }
+
+    static constexpr size_t size() { return buckets; }
+    uint64_t operator[](size_t idx) const { return m_counts[idx]; }
+
+    uint64_t total() const { return m_total; }
+    uint64_t sum() const { return m_sum; }
+    double mean() const { return m_total ? (double)m_sum / m_total : 0; }
+
+    /* same as lfa_histogram::quantile() */
+    uint64_t quantile(double q) const
+    {
+        if (!m_total) {
+            return 0;
+        }
+        return bucket_max(lfa_rank_bucket(m_counts, buckets, m_total, q));
+    }
+
+private:
+    uint64_t m_counts[buckets] = {};
+    uint64_t m_total = 0;
+    uint64_t m_sum = 0;
+};
+
+/* One key tracked by lfa_topk */
+struct lfa_topk_entry {
+    uint64_t key;
+    uint64_t count; /* upper bound on occurrences (0 = unused) */
+    uint64_t error; /* count - error is a lower bound */
+};
+
+/*
+ * Approximate top-K (most frequent keys), using the Space-Saving
+ * algorithm with K counters. To keep accum() O(1), the counters are
+ * split into sets of Ways entries (selected by a hash of the key) and
+ * only one set is searched; a new key replaces the least frequent key
+ * of its set, inheriting its count as error. A key is always tracked
+ * if it makes up more than 1 / Ways of the keys hashed to its set (for
+ * evenly spread keys, roughly total / K occurrences).
+ */
+template<size_t K = 32, size_t Ways = 4>
+class lfa_topk
+{
+    static constexpr size_t sets = K / Ways;
+    static_assert(K % Ways == 0 && (sets & (sets - 1)) == 0,
+                  "K / Ways must be a power of two");
+
+public:
+    void accum(const uint64_t &key) { add(key, 1, 0); }
+
+    void merge(const lfa_topk &other)
+    {
+        for (auto &e : other.m_entries) {
+            if (e.count) {
+                add(e.key, e.count, e.error);
+            }
+        }
+    }
+
+    const lfa_topk &report() { return *this; }
+
+    void reset()
+    {
+        std::fill_n(m_entries, K, lfa_topk_entry{});
+        m_total = 0;
+    }
+
+    uint64_t total() const { return m_total; }
+
+    /*
+     * Copies up to n tracked keys into out, most frequent first, and
+     * returns the number copied.
+     */
+    size_t top(lfa_topk_entry *out, size_t n) const
+    {
+        lfa_topk_entry sorted[K];
+        size_t used = 0;
+        for (auto &e : m_entries) {
+            if (e.count) {
+                sorted[used++] = e;
+            }
+        }
+
+        n = std::min(n, used);
+        std::partial_sort(sorted, sorted + n, sorted + used,
+                          [](const lfa_topk_entry &a, const lfa_topk_entry &b) {
+                              return a.count > b.count;
+                          });
+        std::copy_n(sorted, n, out);
+        return n;
+    }
+
+private:
+    lfa_topk_entry m_entries[K] = {};
+    uint64_t m_total = 0;
+
+    static size_t set_of(uint64_t key)
+    {
+        // Fibonacci hashing (the high bits are best mixed)
+        return (size_t)((key * UINT64_C(0x9E3779B97F4A7C15)) >> 32) &
+               (sets - 1);
+    }
+
+    void add(uint64_t key, uint64_t count, uint64_t error)
+    {
+        m_total += count;
+
+        lfa_topk_entry *set = m_entries + set_of(key) * Ways;
+        lfa_topk_entry *min = set;
+        for (size_t i = 0; i < Ways; i++) {
+            if (set[i].count && set[i].key == key) {
+                set[i].count += count;
+                set[i].error += error;
+                return;
+            }
+            if (set[i].count < min->count) {
+                min = &set[i];
+            }
+        }
+
+        // replace the least frequent key (or an unused entry)
+        *min = {key, min->count + count, min->count + error};
+    }
+};
+
+#endif // ACCUM_BUFS_H
@@ -0,0 +1,35 @@
+/* Minimal helpers shared by the benchmark programs */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+static inline uint64_t bench_now_ns()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+/* Returns the p-th percentile (0-100) of samples (sorting them) */
+static inline uint64_t bench_percentile(std::vector<uint64_t> &samples,
+                                        double p)
+{
+    if (samples.empty()) {
+        return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t idx = (size_t)(p / 100 * (samples.size() - 1) + 0.5);
+    return samples[idx];
+}
+
+/* Prevents the compiler from optimizing away a computed value */
+template<typename T>
+static inline void bench_keep(const T &val)
+{
+    asm volatile("" : : "g"(&val) : "memory");
+}
+
+#endif // BENCH_H
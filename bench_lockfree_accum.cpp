@@ -0,0 +1,195 @@
+/*
+ * Benchmark for lockfree_accum under producer/reporter contention.
+ *
+ * One producer thread calls accum() as fast as possible while one
+ * reporter thread calls report()/reset() at a fixed interval (0 means
+ * back-to-back). A std::mutex + double buffer implementation is run
+ * for comparison. The lockfree_accum variants are built with LFA_STATS
+ * (the direct/discard columns are 0 for the mutex). Output is CSV, one
+ * line per configuration:
+ *
+ *   accum_ops_per_sec - accum() calls per second in the producer
+ *   copy_ratio        - fraction of accum() calls that copied a buffer
+ *   direct_ratio      - fraction of accum() calls into the valid buffer
+ *                       without a copy (since a report was in progress)
+ *   discard_ratio     - fraction of accum() calls whose copy was thrown
+ *                       away due to a simultaneous report()
+ *   report_*_ns       - latency of report() calls (hits and misses)
+ *
+ * Usage: bench_lockfree_accum [ms per configuration]
+ */
+#include "bench.h"
+#include "lockfree_accum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/* counts copies made by accum() (only written by the producer) */
+static uint64_t g_copies;
+
+template<int N>
+class bench_buf
+{
+public:
+    bench_buf &operator=(const bench_buf &other)
+    {
+        std::copy(other.counts, other.counts + N, counts);
+        total = other.total;
+        g_copies++;
+        return *this;
+    }
+
+    void accum(const uint64_t &val)
+    {
+        counts[val % N]++;
+        total++;
+    }
+
+    void merge(const bench_buf &other)
+    {
+        for (int i = 0; i < N; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+    }
+
+    const uint64_t &report() { return total; }
+
+    void reset()
+    {
+        std::fill(counts, counts + N, 0);
+        total = 0;
+    }
+
+private:
+    uint64_t counts[N]{};
+    uint64_t total = 0;
+};
+
+/* Baseline: mutex-protected double buffer with the same interface */
+template<class Buf, class Val>
+class mutex_accum
+{
+public:
+    void accum(const Val &val)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_bufs[m_cur].accum(val);
+        m_dirty = true;
+    }
+
+    void flush() {}
+
+    const Val *report()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_dirty) {
+            return nullptr;
+        }
+        /* writer switches to the other (already reset) buffer */
+        m_cur ^= 1;
+        m_dirty = false;
+        return &m_bufs[m_cur ^ 1].report();
+    }
+
+    void reset() { m_bufs[m_cur ^ 1].reset(); }
+
+    lockfree_accum_stats stats() const { return {}; }
+
+private:
+    std::mutex m_mutex;
+    Buf m_bufs[2]{};
+    int m_cur = 0;
+    bool m_dirty = false;
+};
+
+static int g_run_ms = 100;
+
+template<class Accum>
+static void run(const char *impl, int buf_bytes, int interval_us)
+{
+    auto accum = std::make_unique<Accum>();
+    std::atomic_bool stop = false;
+    uint64_t ops = 0;
+
+    g_copies = 0;
+
+    std::thread producer([&]() {
+        uint64_t i = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            for (int j = 0; j < 64; j++) {
+                accum->accum(i++);
+            }
+        }
+        accum->flush();
+        ops = i;
+    });
+
+    std::vector<uint64_t> latencies;
+    uint64_t start = bench_now_ns();
+    uint64_t end = start + (uint64_t)g_run_ms * 1000000;
+
+    for (uint64_t now = start; now < end; now = bench_now_ns()) {
+        uint64_t t0 = bench_now_ns();
+        const uint64_t *r = accum->report();
+        latencies.push_back(bench_now_ns() - t0);
+        if (r) {
+            bench_keep(*r);
+            accum->reset();
+        }
+        if (interval_us) {
+            std::this_thread::sleep_for(std::chrono::microseconds(interval_us));
+        }
+    }
+
+    stop = true;
+    producer.join();
+
+    double secs = (bench_now_ns() - start) / 1e9;
+    double per_op = ops ? 1.0 / ops : 0.0;
+    lockfree_accum_stats st = accum->stats();
+    printf("%s,%d,%d,%.0f,%.3g,%.3g,%.3g,%zu,%llu,%llu,%llu\n", impl,
+           buf_bytes, interval_us, ops / secs, g_copies * per_op,
+           st.direct * per_op, st.discard * per_op, latencies.size(),
+           (unsigned long long)bench_percentile(latencies, 50),
+           (unsigned long long)bench_percentile(latencies, 99),
+           (unsigned long long)bench_percentile(latencies, 100));
+    fflush(stdout);
+}
+
+template<int N>
+static void run_size()
+{
+    using buf = bench_buf<N>;
+    const int bytes = N * sizeof(uint64_t);
+    constexpr unsigned S = LFA_STATS;
+
+    for (int interval_us : {0, 100, 10000}) {
+        run<lockfree_accum<buf, uint64_t, S>>("lockfree", bytes, interval_us);
+        run<lockfree_accum<buf, uint64_t, S | LFA_RELAXED>>(
+            "lockfree_relaxed", bytes, interval_us);
+        run<lockfree_accum<buf, uint64_t, S | LFA_ISOLATE>>(
+            "lockfree_isolate", bytes, interval_us);
+        run<lockfree_accum<buf, uint64_t, S | LFA_DELTA>>(
+            "lockfree_delta", bytes, interval_us);
+        run<mutex_accum<buf, uint64_t>>("mutex", bytes, interval_us);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        g_run_ms = atoi(argv[1]);
+    }
+
+    printf("impl,buf_bytes,report_interval_us,accum_ops_per_sec,copy_ratio,"
+           "direct_ratio,discard_ratio,reports,report_p50_ns,report_p99_ns,"
+           "report_max_ns\n");
+
+    run_size<8>();
+    run_size<512>();
+    run_size<8192>();
+    return 0;
+}
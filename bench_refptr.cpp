@@ -0,0 +1,189 @@
+/*
+ * Benchmarks for refptr, ownptr, weakptr and reflist assignment.
+ *
+ * 1. Each assignment operator is compared against util::reconstruct()
+ *    (destroy + placement-construct), which is how these types used
+ *    to implement assignment.
+ * 2. refptr and weakptr are compared against std::shared_ptr and
+ *    std::weak_ptr, including weakptr churn on a target which already
+ *    has N weak references.
+ *
+ * Output is CSV, one line per case:
+ *
+ *   ns_per_op - average time of one operation (best of 3 runs)
+ *
+ * Usage: bench_refptr [iterations]
+ */
+#include "bench.h"
+#include "reflist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory>
+
+struct obj : public ref_owned<obj>, public weak_target<obj> {
+    int val = 0;
+};
+
+struct plain_obj {
+    int val = 0;
+};
+
+static long g_iters = 1000000;
+
+/* runs func(i) for i in [0, iters) and prints the best of 3 runs */
+template<typename F>
+static void run(const char *type, const char *op, const char *impl,
+                long iters, const F &func)
+{
+    double best = 0;
+    for (int rep = 0; rep < 3; rep++) {
+        uint64_t start = bench_now_ns();
+        for (long i = 0; i < iters; i++) {
+            func(i);
+        }
+        double ns = (double)(bench_now_ns() - start) / iters;
+        best = rep ? std::min(best, ns) : ns;
+    }
+    printf("%s,%s,%s,%.2f\n", type, op, impl, best);
+}
+
+/*
+ * Copy-assigns src[0] and src[1] alternately ("copy"), or src[0] each
+ * time ("copy_same"), and move-assigns back and forth ("move").
+ */
+template<typename P>
+static void run_type(const char *type, P (&src)[2])
+{
+    P dest;
+    if constexpr (std::is_copy_assignable_v<P>) {
+        run(type, "copy", "assign", g_iters,
+            [&](long i) { dest = src[i & 1]; });
+        run(type, "copy", "reconstruct", g_iters,
+            [&](long i) { util::reconstruct(dest, src[i & 1]); });
+        run(type, "copy_same", "assign", g_iters,
+            [&](long) { dest = src[0]; });
+        run(type, "copy_same", "reconstruct", g_iters,
+            [&](long) { util::reconstruct(dest, src[0]); });
+    }
+    // bench_keep() stops the two moves from being merged
+    run(type, "move", "assign", g_iters, [&](long i) {
+        dest = std::move(src[i & 1]);
+        bench_keep(dest);
+        src[i & 1] = std::move(dest);
+    });
+    run(type, "move", "reconstruct", g_iters, [&](long i) {
+        util::reconstruct(dest, std::move(src[i & 1]));
+        bench_keep(dest);
+        util::reconstruct(src[i & 1], std::move(dest));
+    });
+    bench_keep(dest);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        g_iters = atol(argv[1]);
+    }
+
+    printf("type,op,impl,ns_per_op\n");
+
+    obj objs[2];
+    refptr<obj> refs[2] = {refptr<obj>(new obj), refptr<obj>(new obj)};
+    ownptr<obj> owns[2] = {ownptr<obj>(new obj), ownptr<obj>(new obj)};
+    weakptr<obj> weaks[2] = {weakptr<obj>(&objs[0]), weakptr<obj>(&objs[1])};
+
+    // other weakptrs to the same targets
+    std::vector<weakptr<obj>> others;
+    for (int i = 0; i < 100; i++) {
+        others.emplace_back(&objs[i & 1]);
+    }
+
+    run_type("refptr", refs);
+    run_type("ownptr", owns);
+    run_type("weakptr", weaks);
+
+    // refptr vs. std::shared_ptr
+    auto shared = std::make_shared<plain_obj>();
+    run("refptr", "copy_destroy", "refptr", g_iters, [&](long) {
+        refptr<obj> copy = refs[0];
+        bench_keep(copy);
+    });
+    run("refptr", "copy_destroy", "shared_ptr", g_iters, [&](long) {
+        std::shared_ptr<plain_obj> copy = shared;
+        bench_keep(copy);
+    });
+    run("refptr", "create_destroy", "refptr", g_iters, [&](long) {
+        refptr<obj> ptr(new obj);
+        bench_keep(ptr);
+    });
+    run("refptr", "create_destroy", "shared_ptr", g_iters, [&](long) {
+        auto ptr = std::make_shared<plain_obj>();
+        bench_keep(ptr);
+    });
+
+    std::shared_ptr<plain_obj> shareds[2] = {std::make_shared<plain_obj>(),
+                                             std::make_shared<plain_obj>()};
+    std::shared_ptr<plain_obj> shared_dest;
+    run("refptr", "move", "shared_ptr", g_iters, [&](long i) {
+        shared_dest = std::move(shareds[i & 1]);
+        bench_keep(shared_dest);
+        shareds[i & 1] = std::move(shared_dest);
+    });
+
+    // weakptr churn on a target with N other weak references
+    for (int n : {0, 16, 256}) {
+        refptr<obj> target(new obj);
+        auto shared_target = std::make_shared<plain_obj>();
+        std::vector<weakptr<obj>> weak_refs;
+        std::vector<std::weak_ptr<plain_obj>> std_weak_refs;
+        for (int i = 0; i < n; i++) {
+            weak_refs.emplace_back(target);
+            std_weak_refs.emplace_back(shared_target);
+        }
+
+        char op[32];
+        snprintf(op, sizeof op, "create_destroy_n%d", n);
+        run("weakptr", op, "weakptr", g_iters, [&](long) {
+            weakptr<obj> weak(target);
+            bench_keep(weak);
+        });
+        run("weakptr", op, "weak_ptr", g_iters, [&](long) {
+            std::weak_ptr<plain_obj> weak(shared_target);
+            bench_keep(weak);
+        });
+
+        // destroying a target resets all its weak references
+        long target_iters = std::max(g_iters / (n + 1), 1L);
+        snprintf(op, sizeof op, "target_destroy_n%d", n);
+        run("weakptr", op, "weakptr", target_iters, [&](long) {
+            refptr<obj> temp(new obj);
+            for (auto &w : weak_refs) {
+                w.reset(temp.get());
+            }
+        });
+        run("weakptr", op, "weak_ptr", target_iters, [&](long) {
+            auto temp = std::make_shared<plain_obj>();
+            for (auto &w : std_weak_refs) {
+                w = temp;
+            }
+        });
+    }
+
+    // reflist copies (storage can be reused by assignment)
+    reflist<obj> src, dest;
+    for (int i = 0; i < 1000; i++) {
+        src.append(new obj);
+    }
+
+    long list_iters = std::max(g_iters / 1000, 1L);
+    run("reflist", "copy_1000", "assign", list_iters, [&](long) {
+        dest = src;
+        bench_keep(dest);
+    });
+    run("reflist", "copy_1000", "reconstruct", list_iters, [&](long) {
+        util::reconstruct(dest, src);
+        bench_keep(dest);
+    });
+
+    return 0;
+}
@@ -0,0 +1,440 @@
+/*
+ * concurrent_reflist.h
+ * Copyright 2025 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+#ifndef CONCURRENT_REFLIST_H
+#define CONCURRENT_REFLIST_H
+
+#include "refptr.h"
+#include <assert.h>
+#include <limits.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ * Thread-safe variant of reflist, for lists which are modified
+ * occasionally (by any thread) and iterated often (by many threads).
+ * T should inherit refcounted_mt (e.g. via ref_owned_mt).
+ *
+ * Readers never block: an iterator reads a published array of
+ * pointers directly, taking only a reference to the current item.
+ * Writers are serialized by a mutex. Appends and prepends are written
+ * into headroom at the ends of the array, which is copied only when it
+ * needs to be regrown or compacted. Removed items and replaced arrays
+ * are reclaimed once no iterator created before the change remains
+ * (tracked with a two-phase epoch counter), which is checked during
+ * each modification and by reclaim(). Writers never wait for readers,
+ * so it is safe to modify the list while iterating it.
+ *
+ * Iterators behave like those of reflist (see reflist.h): they stay on
+ * the same item, do not visit items added after they were created,
+ * and skip over removed items. Only forward iteration is provided.
+ *
+ * Iterators should be short-lived, since each one delays reclamation.
+ * The list must not be destroyed while any iterators exist.
+ */
+template<typename T>
+class concurrent_reflist
+{
+    struct array;
+
+public:
+    class iter
+    {
+    public:
+        friend concurrent_reflist;
+
+        iter(iter &&it)
+            : m_list(it.m_list), m_array(it.m_array), m_parity(it.m_parity),
+              m_end(it.m_end), m_idx(it.m_idx), m_val(std::move(it.m_val))
+        {
+            it.m_list = nullptr;
+        }
+
+        ~iter()
+        {
+            m_val.reset();
+            if (m_list) {
+                m_list->read_unlock(m_parity);
+            }
+        }
+
+        iter(const iter &) = delete;
+        iter &operator=(const iter &) = delete;
+        iter &operator=(iter &&) = delete;
+
+        explicit operator bool() { return (bool)m_val; }
+
+        T *get() { return m_val.get(); }
+
+        T &operator*() { return *get(); }
+        T *operator->() { return get(); }
+
+        // intentionally comparing only index (as for reflist::iter)
+        bool operator==(const iter &it) { return m_idx == it.m_idx; }
+        bool operator!=(const iter &it) { return m_idx != it.m_idx; }
+
+        iter &operator++()
+        {
+            m_idx++;
+            find_valid();
+            return *this;
+        }
+
+    private:
+        concurrent_reflist *m_list = nullptr; // null for end()
+        array *m_array = nullptr;
+        unsigned m_parity = 0;
+        int m_end = 0, m_idx = INT_MAX - 1;
+        refptr<T> m_val;
+
+        iter() {}
+
+        iter(concurrent_reflist &list) : m_list(&list)
+        {
+            m_parity = list.read_lock();
+            m_array = list.m_current.load(std::memory_order_acquire);
+            // m_first/m_last are published after the slots are written
+            m_idx = m_array->first.load(std::memory_order_acquire);
+            m_end = m_array->last.load(std::memory_order_acquire);
+            find_valid();
+        }
+
+        void find_valid()
+        {
+            // the list still holds a reference to any item we can
+            // load, so it's safe to add our own reference
+            for (; m_idx < m_end; m_idx++) {
+                auto &slot = m_array->slots[m_idx];
+                if (T *item = slot.load(std::memory_order_acquire)) {
+                    m_val.reset(item);
+                    return;
+                }
+            }
+            m_val.reset();
+            m_idx = INT_MAX - 1; // all past-end iters are equal
+        }
+    };
+
+    concurrent_reflist() : m_current(new array(MIN_GROW))
+    {
+        // checked here rather than in the class body, so that T may
+        // still be incomplete where the list is declared
+        static_assert(decltype(is_refcounted_mt((T *)nullptr))::value,
+                      "T must inherit refcounted_mt");
+    }
+
+    ~concurrent_reflist()
+    {
+        assert(m_readers[0].load() == 0 && m_readers[1].load() == 0);
+        clear_retired(m_waiting);
+        clear_retired(m_pending);
+        for (auto &ptr : m_owned) {
+            ptr.reset();
+        }
+        delete m_current.load(std::memory_order_relaxed);
+    }
+
+    concurrent_reflist(const concurrent_reflist &) = delete;
+    concurrent_reflist &operator=(const concurrent_reflist &) = delete;
+
+    iter begin() { return iter(*this); }
+    iter end() { return iter(); }
+
+    bool empty() const { return !size(); }
+    int size() const { return m_count.load(std::memory_order_relaxed); }
+
+    void append(const refptr<T> &ptr) { append(ptr.get()); }
+    void prepend(const refptr<T> &ptr) { prepend(ptr.get()); }
+
+    void append(T *item)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        array *cur = current();
+        int last = cur->last.load(std::memory_order_relaxed);
+        if (last == cur->size) {
+            // keep the headroom at the front for prepend()
+            int front = cur->first.load(std::memory_order_relaxed);
+            cur = regrow(front, std::max(count(), MIN_GROW));
+            last = cur->last.load(std::memory_order_relaxed);
+        }
+        store(cur, last, item);
+        cur->last.store(last + 1, std::memory_order_release);
+        reclaim_locked();
+    }
+
+    void prepend(T *item)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        array *cur = current();
+        int first = cur->first.load(std::memory_order_relaxed);
+        if (first == 0) {
+            // keep the headroom at the back for append()
+            int back = cur->size - cur->last.load(std::memory_order_relaxed);
+            cur = regrow(std::max(count(), MIN_GROW), back);
+            first = cur->first.load(std::memory_order_relaxed);
+        }
+        store(cur, first - 1, item);
+        cur->first.store(first - 1, std::memory_order_release);
+        reclaim_locked();
+    }
+
+    template<typename P>
+    bool remove(const P &ptr)
+    {
+        const T *item = raw_ptr(ptr);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        array *cur = current();
+        int pos = cur->find(item);
+        if (!item || pos < 0) {
+            return false;
+        }
+
+        // null the item in the replaced arrays as well, so that no
+        // iterator will visit it after this point
+        cur->slots[pos].store(nullptr, std::memory_order_relaxed);
+        for (auto &old : m_waiting.arrays) {
+            old->clear(item);
+        }
+        for (auto &old : m_pending.arrays) {
+            old->clear(item);
+        }
+
+        m_pending.refs.push_back(std::move(m_owned[pos]));
+        m_count.store(count() - 1, std::memory_order_relaxed);
+
+        // compact once nulls outnumber live items
+        int used = cur->last.load(std::memory_order_relaxed) -
+                   cur->first.load(std::memory_order_relaxed);
+        if (used > 2 * count() + MIN_GROW) {
+            regrow(MIN_GROW, MIN_GROW);
+        }
+
+        reclaim_locked();
+        return true;
+    }
+
+    template<typename P>
+    bool contains(const P &ptr)
+    {
+        const T *item = raw_ptr(ptr);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return item && current()->find(item) >= 0;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        array *cur = current();
+        m_current.store(new array(MIN_GROW), std::memory_order_release);
+        m_pending.arrays.emplace_back(cur);
+
+        for (auto &old : m_waiting.arrays) {
+            old->clear_all();
+        }
+        for (auto &old : m_pending.arrays) {
+            old->clear_all();
+        }
+
+        for (auto &ptr : m_owned) {
+            if (ptr) {
+                m_pending.refs.push_back(std::move(ptr));
+            }
+        }
+        m_owned.assign(MIN_GROW, refptr<T>());
+        m_count.store(0, std::memory_order_relaxed);
+        reclaim_locked();
+    }
+
+    /*
+     * Frees removed items and replaced arrays that are no longer
+     * visible to any iterator. This is done automatically during each
+     * modification, but can also be called explicitly (e.g. while
+     * idle), since it may take two calls to free everything.
+     */
+    void reclaim()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        reclaim_locked();
+    }
+
+private:
+    static constexpr int MIN_GROW = 4;
+
+    struct array {
+        int size;
+        std::atomic<int> first, last;
+        std::unique_ptr<std::atomic<T *>[]> slots;
+
+        array(int size)
+            : size(size), first(size / 2), last(size / 2),
+              slots(new std::atomic<T *>[size])
+        {
+            clear_all();
+        }
+
+        int find(const T *item) const
+        {
+            int end = last.load(std::memory_order_relaxed);
+            for (int pos = first.load(std::memory_order_relaxed); pos < end;
+                 pos++) {
+                if (slots[pos].load(std::memory_order_relaxed) == item) {
+                    return pos;
+                }
+            }
+            return -1;
+        }
+
+        void clear(const T *item)
+        {
+            int pos = find(item);
+            if (pos >= 0) {
+                slots[pos].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        void clear_all()
+        {
+            for (int pos = 0; pos < size; pos++) {
+                slots[pos].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    // things to be freed once no iterator can see them
+    struct retired {
+        std::vector<std::unique_ptr<array>> arrays;
+        std::vector<refptr<T>> refs;
+    };
+
+    std::mutex m_mutex;
+    std::atomic<array *> m_current;
+    std::atomic<int> m_count = 0;
+
+    // written by the writer (under m_mutex) only
+    std::vector<refptr<T>> m_owned = std::vector<refptr<T>>(MIN_GROW);
+    retired m_pending; // retired in the current epoch
+    retired m_waiting; // retired in the previous epoch
+
+    // number of active iterators, by parity of the epoch they started in
+    alignas(64) std::atomic<unsigned> m_epoch = 0;
+    std::atomic<int> m_readers[2] = {0, 0};
+
+    template<typename U, typename C>
+    static std::true_type is_refcounted_mt(const refcounted_mt<U, C> *);
+    static std::false_type is_refcounted_mt(...);
+
+    template<typename P>
+    static const T *raw_ptr(const P &ptr)
+    {
+        if constexpr (std::is_convertible_v<const P &, const T *>) {
+            return ptr;
+        } else {
+            return ptr.get();
+        }
+    }
+
+    int count() const { return m_count.load(std::memory_order_relaxed); }
+
+    array *current() { return m_current.load(std::memory_order_relaxed); }
+
+    unsigned read_lock()
+    {
+        while (true) {
+            unsigned epoch = m_epoch.load();
+            m_readers[epoch & 1].fetch_add(1);
+            // recheck, in case the epoch advanced before we were
+            // counted (the writer may then think old readers are done)
+            if (m_epoch.load() == epoch) {
+                return epoch & 1;
+            }
+            m_readers[epoch & 1].fetch_sub(1);
+        }
+    }
+
+    void read_unlock(unsigned parity)
+    {
+        m_readers[parity].fetch_sub(1, std::memory_order_release);
+    }
+
+    // stores a new item into an unpublished slot
+    void store(array *cur, int pos, T *item)
+    {
+        if (item) {
+            m_owned[pos].reset(item);
+            m_count.store(count() + 1, std::memory_order_relaxed);
+        }
+        cur->slots[pos].store(item, std::memory_order_relaxed);
+    }
+
+    // replaces the current array with a compacted copy (with headroom
+    // added at the front and/or back); must hold m_mutex
+    array *regrow(int front, int back)
+    {
+        array *cur = current();
+        auto next = new array(front + count() + back);
+        std::vector<refptr<T>> owned(next->size);
+
+        int out = front;
+        int first = cur->first.load(std::memory_order_relaxed);
+        int last = cur->last.load(std::memory_order_relaxed);
+        for (int pos = first; pos < last; pos++) {
+            if (m_owned[pos]) {
+                next->slots[out].store(m_owned[pos].get(),
+                                       std::memory_order_relaxed);
+                owned[out++] = std::move(m_owned[pos]);
+            }
+        }
+        next->first.store(front, std::memory_order_relaxed);
+        next->last.store(out, std::memory_order_relaxed);
+
+        m_owned = std::move(owned);
+        m_current.store(next, std::memory_order_release);
+        m_pending.arrays.emplace_back(cur);
+        return next;
+    }
+
+    static void clear_retired(retired &r)
+    {
+        r.refs.clear();
+        r.arrays.clear();
+    }
+
+    // must hold m_mutex
+    void reclaim_locked()
+    {
+        unsigned epoch = m_epoch.load();
+        // readers from the previous epoch are done if their counter
+        // (which readers from the next epoch will share) is zero
+        if (m_readers[(epoch - 1) & 1].load() != 0) {
+            return;
+        }
+        clear_retired(m_waiting);
+        if (!m_pending.arrays.empty() || !m_pending.refs.empty()) {
+            std::swap(m_waiting, m_pending);
+            // new readers can no longer see anything in m_waiting;
+            // it will be freed once readers from this epoch are done
+            m_epoch.store(epoch + 1);
+        }
+    }
+};
+
+#endif // CONCURRENT_REFLIST_H
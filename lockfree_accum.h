@@ -1,5 +1,103 @@
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Cache line size assumed when separating data accessed by different
+ * threads. std::hardware_destructive_interference_size is not used
+ * since its value can vary with compiler flags (GCC warns about this).
+ */
+#ifndef LFA_CACHE_LINE
+#define LFA_CACHE_LINE 64
+#endif
+
+/* Defined when building with ThreadSanitizer (see seqlock_accum) */
+#if defined(__SANITIZE_THREAD__)
+#define LFA_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define LFA_TSAN 1
+#endif
+#endif
+
+/* Blocks (up to timeout) while word == val, or until woken */
+static inline void lfa_wait(std::atomic_uint32_t &word, uint32_t val,
+                            std::chrono::nanoseconds timeout)
+{
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = timeout.count() / 1000000000;
+    ts.tv_nsec = timeout.count() % 1000000000;
+    syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, val, &ts, nullptr, 0);
+#else
+    /* no futex - fall back to polling */
+    (void)word, (void)val;
+    std::chrono::nanoseconds poll = std::chrono::milliseconds(1);
+    std::this_thread::sleep_for(std::min(timeout, poll));
+#endif
+}
+
+static inline void lfa_wake(std::atomic_uint32_t &word)
+{
+#ifdef __linux__
+    syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+/* Optional behaviors for lockfree_accum (may be combined with |) */
+enum : unsigned {
+    LFA_DELTA = 1 << 0,   /* accumulate into a private delta buffer */
+    LFA_ISOLATE = 1 << 1, /* put buffers and state on separate cache lines */
+    LFA_RELAXED = 1 << 2, /* use acquire/release instead of seq_cst */
+    LFA_STATS = 1 << 3,   /* count state transitions (see stats()) */
+};
+
+/* Transition counts returned by lockfree_accum::stats() */
+struct lockfree_accum_stats {
+    uint64_t direct;      /* accum() into a valid buffer while reporting */
+    uint64_t copy;        /* accum() that copied the valid buffer */
+    uint64_t discard;     /* copies discarded due to a simultaneous report */
+    uint64_t fresh;       /* accum() into an empty buffer */
+    uint64_t report_hit;  /* report() that returned a buffer */
+    uint64_t report_miss; /* report() that returned null */
+};
+
+template<class Buf, class Val, int MaxProducers, unsigned Flags>
+class sharded_accum;
+
+/* Detects whether Buf implements accum_range() (see accum_batch) */
+template<class Buf, class It, class = void>
+struct lfa_has_accum_range : std::false_type {
+};
+
+template<class Buf, class It>
+struct lfa_has_accum_range<
+    Buf, It,
+    std::void_t<decltype(std::declval<Buf &>().accum_range(
+        std::declval<It>(), std::declval<It>()))>> : std::true_type {
+};
+
+/* Type returned (by reference) from Buf::report() */
+template<class Buf>
+using lfa_report_t = std::remove_cv_t<
+    std::remove_reference_t<decltype(std::declval<Buf &>().report())>>;
 
 /*
  * Lock-free double-buffer implementation which allows accumulation of
@@ -10,22 +108,76 @@
  *
  *   operator=(const Buf &b);
  *   void accum(const Val &v);
- *   const Val &report();
+ *   const Res &report();
  *   void reset();
  *
  * where:
  *
  *   - accum() adds a value to the buffer (for some sense of "add")
- *   - report() returns the accumulated result (sum)
+ *   - report() returns the accumulated result (sum), which is usually
+ *     a Val but may be any type Res (such as the buffer itself)
  *   - reset() resets the buffer to its initial state
  *
+ * Ready-made buffers (counters, histograms and top-K) can be found in
+ * accum_bufs.h.
+ *
  * The design is probably of limited utility except in very specific
  * situations, but it was a fun exercise to implement.
+ *
+ * Only one thread may call accum() at a time. For multiple producer
+ * threads, see sharded_accum below.
+ *
+ * With LFA_DELTA, accum() adds values to a third (delta) buffer that is
+ * private to the accumulating thread. The delta is merged into one of
+ * the two shared buffers only after report() has been called, so that
+ * copying the valid buffer happens at most once per report() instead
+ * of once per accum(). This requires Buf to implement merge() (see
+ * sharded_accum) and means that values accumulated since the last
+ * report() may be held back until the next accum() or flush().
+ *
+ * With LFA_ISOLATE, each buffer and the state are aligned to separate
+ * cache lines (LFA_CACHE_LINE), so that a reporter reading one buffer
+ * does not contend with the accumulating thread updating the state or
+ * the other buffer. This increases the size of each instance to at
+ * least three (four with LFA_DELTA) cache lines.
+ *
+ * With LFA_RELAXED, state transitions use the weakest memory orderings
+ * that still order buffer access: acquire when claiming a buffer to
+ * write or report, release when publishing a buffer or ending a report.
+ * This avoids full barriers on weakly-ordered CPUs (such as ARM), except
+ * for the report_wait() handshake, which uses a seq_cst fence on each
+ * side (only when accum() makes a buffer valid from none).
+ *
+ * With LFA_STATS, each path through accum() and report() is counted
+ * (using relaxed atomics, so that stats() may be called from any
+ * thread). This is intended for tuning, e.g. to see how often accum()
+ * has to copy a buffer or throw the copy away.
  */
-template<class Buf, class Val>
+template<class Buf, class Val, unsigned Flags = 0>
 class lockfree_accum
 {
 private:
+    template<class, class, int, unsigned>
+    friend class sharded_accum;
+
+    static constexpr bool DELTA = (Flags & LFA_DELTA);
+    static constexpr bool ISOLATE = (Flags & LFA_ISOLATE);
+    static constexpr bool RELAXED = (Flags & LFA_RELAXED);
+    static constexpr bool STATS = (Flags & LFA_STATS);
+
+    /* memory orderings for claiming, publishing, and other accesses */
+    static constexpr std::memory_order ACQUIRE =
+        RELAXED ? std::memory_order_acquire : std::memory_order_seq_cst;
+    static constexpr std::memory_order RELEASE =
+        RELAXED ? std::memory_order_release : std::memory_order_seq_cst;
+    static constexpr std::memory_order ANY =
+        RELAXED ? std::memory_order_relaxed : std::memory_order_seq_cst;
+
+    static constexpr size_t BUF_ALIGN =
+        ISOLATE ? LFA_CACHE_LINE : alignof(Buf);
+    static constexpr size_t STATE_ALIGN =
+        ISOLATE ? LFA_CACHE_LINE : alignof(std::atomic_uint8_t);
+
     /* buffer state pairs */
     enum {
         EMPTY_EMPTY = 0,
@@ -45,14 +197,226 @@ private:
         VALID_REPORT = 14,
     };
 
-    Buf m_bufs[2]{};
+    /* padded to a cache line with LFA_ISOLATE */
+    struct alignas(BUF_ALIGN) aligned_buf : public Buf {
+    };
+
+    struct alignas(BUF_ALIGN) delta_state {
+        Buf buf{};
+        bool dirty = false;
+        std::atomic_bool wanted = true; /* set by report() */
+    };
+
+    struct no_delta_state {
+    };
+
+    /* each counter is written by only one thread */
+    struct stat_counters {
+        std::atomic_uint64_t direct = 0;
+        std::atomic_uint64_t copy = 0;
+        std::atomic_uint64_t discard = 0;
+        std::atomic_uint64_t fresh = 0;
+        std::atomic_uint64_t report_hit = 0;
+        std::atomic_uint64_t report_miss = 0;
+    };
+
+    struct no_stat_counters {
+    };
+
+    aligned_buf m_bufs[2]{};
+
+    alignas(STATE_ALIGN) std::atomic_uint8_t m_state = EMPTY_EMPTY;
 
-    std::atomic_uint8_t m_state = EMPTY_EMPTY;
+    /* used by report_wait() */
+    std::atomic_bool m_waiting = false;
+    std::atomic_uint32_t m_wake = 0;
+
+    std::conditional_t<STATS, stat_counters, no_stat_counters> m_stats;
+    std::conditional_t<DELTA, delta_state, no_delta_state> m_delta;
 
 public:
     void accum(const Val &val)
     {
-        uint8_t state = m_state.load();
+        if constexpr (DELTA) {
+            m_delta.buf.accum(val);
+            m_delta.dirty = true;
+            publish_if_wanted();
+        } else {
+            update([&](Buf &buf) { buf.accum(val); });
+        }
+    }
+
+    /*
+     * Accumulates a range of values with a single pass through the
+     * state machine. If Buf implements
+     *
+     *   template<class It> void accum_range(It first, It last);
+     *
+     * the whole range is passed to it, otherwise accum() is called for
+     * each value. The range may be visited more than once (if a copy
+     * is discarded), so It must be at least a forward iterator.
+     */
+    template<class It>
+    void accum_batch(It first, It last)
+    {
+        if (first == last) {
+            return;
+        }
+
+        auto apply = [&](Buf &buf) {
+            if constexpr (lfa_has_accum_range<Buf, It>::value) {
+                buf.accum_range(first, last);
+            } else {
+                for (It it = first; it != last; ++it) {
+                    buf.accum(*it);
+                }
+            }
+        };
+
+        if constexpr (DELTA) {
+            apply(m_delta.buf);
+            m_delta.dirty = true;
+            publish_if_wanted();
+        } else {
+            update(apply);
+        }
+    }
+
+    /*
+     * With LFA_DELTA, makes any values held in the delta buffer
+     * available to report(). Must be called from the accumulating
+     * thread. Without LFA_DELTA, does nothing.
+     */
+    void flush()
+    {
+        if constexpr (DELTA) {
+            if (m_delta.dirty) {
+                publish();
+            }
+        }
+    }
+
+    const lfa_report_t<Buf> *report()
+    {
+        Buf *buf = report_buf();
+        return buf ? &buf->report() : nullptr;
+    }
+
+    /*
+     * Like report(), but if no buffer is valid, blocks until accum()
+     * makes one valid or the timeout expires (returning null). With
+     * LFA_DELTA, held-back values are published by the next accum().
+     */
+    template<class Rep, class Period>
+    const lfa_report_t<Buf> *
+    report_wait(std::chrono::duration<Rep, Period> timeout)
+    {
+        const lfa_report_t<Buf> *val = report();
+        if (val) {
+            return val;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+
+        while (true) {
+            /*
+             * Set m_waiting before checking again for a valid buffer.
+             * Either the check sees the buffer made valid by accum(),
+             * or accum() sees m_waiting and increments m_wake (which
+             * makes the wait return immediately if not yet waiting).
+             * With LFA_RELAXED, this needs a full fence on both sides
+             * (here and in accum()), since the state accesses alone no
+             * longer order the store before the load.
+             */
+            uint32_t wake = m_wake.load();
+            m_waiting = true;
+            if constexpr (RELAXED) {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+
+            val = report();
+            auto now = std::chrono::steady_clock::now();
+            if (val || now >= deadline) {
+                break;
+            }
+
+            lfa_wait(m_wake, wake, deadline - now);
+        }
+
+        m_waiting = false;
+        return val;
+    }
+
+    /* Requires LFA_STATS. May be called from any thread. */
+    lockfree_accum_stats stats() const
+    {
+        static_assert(STATS, "stats() requires LFA_STATS");
+        auto get = [](const std::atomic_uint64_t &counter) {
+            return counter.load(std::memory_order_relaxed);
+        };
+        return {get(m_stats.direct),     get(m_stats.copy),
+                get(m_stats.discard),    get(m_stats.fresh),
+                get(m_stats.report_hit), get(m_stats.report_miss)};
+    }
+
+    void reset()
+    {
+        [[maybe_unused]] uint8_t state = m_state.load(ANY);
+
+        /* Must be reporting. */
+        assert(state == REPORT_EMPTY || state == REPORT_ACCUM ||
+               state == REPORT_VALID || state == EMPTY_REPORT ||
+               state == ACCUM_REPORT || state == VALID_REPORT);
+
+        /*
+         * Just reset the state, accum() will reset the buffer later.
+         *
+         * Transition table:
+         *   REPORT_EMPTY(4)  -> EMPTY_EMPTY_ALT(8)
+         *   REPORT_ACCUM(5)  -> EMPTY_ACCUM(9)
+         *   REPORT_VALID(6)  -> EMPTY_VALID(10)
+         *   EMPTY_REPORT(12) -> EMPTY_EMPTY(0)
+         *   ACCUM_REPORT(13) -> ACCUM_EMPTY(1)
+         *   VALID_REPORT(14) -> VALID_EMPTY(2)
+         */
+        m_state.fetch_xor(12, RELEASE);
+    }
+
+private:
+    /* No-op without LFA_STATS */
+    void count(std::atomic_uint64_t stat_counters::*counter)
+    {
+        if constexpr (STATS) {
+            auto &c = m_stats.*counter;
+            c.store(c.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+        }
+    }
+
+    /* Merges the delta buffer into a shared buffer (LFA_DELTA only) */
+    void publish()
+    {
+        m_delta.wanted.store(false, std::memory_order_relaxed);
+        update([&](Buf &buf) { buf.merge(m_delta.buf); });
+        m_delta.buf.reset();
+        m_delta.dirty = false;
+    }
+
+    void publish_if_wanted()
+    {
+        if (m_delta.wanted.load(std::memory_order_relaxed)) {
+            publish();
+        }
+    }
+
+    /*
+     * Runs the accumulation state machine once, calling apply(buf) to
+     * add to whichever buffer is selected.
+     */
+    template<class F>
+    void update(const F &apply)
+    {
+        uint8_t state = m_state.load(ANY);
 
         /* Must not already be accumulating */
         assert(state != ACCUM_EMPTY && state != VALID_ACCUM &&
@@ -72,10 +436,10 @@ public:
          * m_state, which will be handled in other cases.
          */
         if ((state == REPORT_VALID || state == VALID_REPORT) &&
-            m_state.compare_exchange_strong(state, state - 1)) {
+            m_state.compare_exchange_strong(state, state - 1, ACQUIRE, ANY)) {
 
             uint8_t valid_idx = (state >> 3) ^ 1;
-            m_bufs[valid_idx].accum(val);
+            apply(m_bufs[valid_idx]);
 
             /*
              * Possible simultaneous transitions due to reset():
@@ -88,9 +452,15 @@ public:
              *   ACCUM_REPORT(13) -> VALID_REPORT(14)
              *   ACCUM_EMPTY(1)   -> VALID_EMPTY(2)
              */
-            state = ++m_state;
+            state = m_state.fetch_add(1, RELEASE) + 1;
             assert(state == VALID_EMPTY || state == REPORT_VALID ||
                    state == EMPTY_VALID || state == VALID_REPORT);
+            count(&stat_counters::direct);
+
+            /* after a reset(), no other buffer is valid */
+            if (state == VALID_EMPTY || state == EMPTY_VALID) {
+                wake_reporter();
+            }
             return;
         }
 
@@ -108,14 +478,14 @@ public:
          * m_state, which will be handled in other cases.
          */
         if ((state == VALID_EMPTY || state == EMPTY_VALID) &&
-            m_state.compare_exchange_strong(state, state + 1)) {
+            m_state.compare_exchange_strong(state, state + 1, ACQUIRE, ANY)) {
 
             uint8_t valid_idx = (state >> 3);
             uint8_t empty_idx = valid_idx ^ 1;
 
             m_bufs[empty_idx].reset();
             m_bufs[empty_idx] = m_bufs[valid_idx];
-            m_bufs[empty_idx].accum(val);
+            apply(m_bufs[empty_idx]);
 
             /*
              * Now mark the updated copy as valid and the original
@@ -126,7 +496,9 @@ public:
              *   ACCUM_VALID(11) -> VALID_EMPTY(2)
              */
             state++;
-            if (m_state.compare_exchange_strong(state, (state - 1) ^ 8)) {
+            if (m_state.compare_exchange_strong(state, (state - 1) ^ 8,
+                                                RELEASE, ANY)) {
+                count(&stat_counters::copy);
                 return;
             }
 
@@ -141,9 +513,10 @@ public:
              *   ACCUM_REPORT(13) -> EMPTY_REPORT(12)
              *   ACCUM_EMPTY(1)   -> EMPTY_EMPTY(0)
              */
-            state = --m_state;
+            state = m_state.fetch_sub(1, ANY) - 1;
             assert(state == EMPTY_EMPTY || state == REPORT_EMPTY ||
                    state == EMPTY_EMPTY_ALT || state == EMPTY_REPORT);
+            count(&stat_counters::discard);
         }
 
         /*
@@ -163,14 +536,19 @@ public:
         if (state == EMPTY_EMPTY || state == REPORT_EMPTY ||
             state == EMPTY_EMPTY_ALT || state == EMPTY_REPORT) {
 
-            uint8_t empty_idx = (state >> 3) ^ 1;
-
-            state = ++m_state;
+            state = m_state.fetch_add(1, ACQUIRE) + 1;
             assert(state == ACCUM_EMPTY || state == REPORT_ACCUM ||
                    state == EMPTY_ACCUM || state == ACCUM_REPORT);
 
-            m_bufs[empty_idx].reset();
-            m_bufs[empty_idx].accum(val);
+            /*
+             * The accumulating buffer is the first one for ACCUM_EMPTY
+             * and ACCUM_REPORT, the second for REPORT_ACCUM and
+             * EMPTY_ACCUM. (A simultaneous reset() cannot change it.)
+             */
+            uint8_t accum_idx = ((state >> 3) ^ (state >> 2)) & 1;
+
+            m_bufs[accum_idx].reset();
+            apply(m_bufs[accum_idx]);
 
             /*
              * Transition table:
@@ -179,17 +557,47 @@ public:
              *   ACCUM_REPORT(13) -> VALID_REPORT(14)
              *   ACCUM_EMPTY(1)   -> VALID_EMPTY(2)
              */
-            state = ++m_state;
+            state = m_state.fetch_add(1, RELEASE) + 1;
             assert(state == VALID_EMPTY || state == REPORT_VALID ||
                    state == EMPTY_VALID || state == VALID_REPORT);
+
+            count(&stat_counters::fresh);
+
+            /* no buffer was valid before */
+            wake_reporter();
         } else {
             assert(false);
         }
     }
 
-    const Val *report()
+    /*
+     * Wakes report_wait() if blocked. Called when update() makes a
+     * buffer valid while no other buffer is: always on the path that
+     * accumulates into an empty buffer, and on the path that adds to
+     * the valid buffer if reset() ended the report meanwhile. (The
+     * copy path starts and ends with a valid buffer.)
+     */
+    void wake_reporter()
     {
-        uint8_t state = m_state.load();
+        /* pairs with the fence in report_wait() */
+        if constexpr (RELAXED) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        if (m_waiting.load()) {
+            m_wake++;
+            lfa_wake(m_wake);
+        }
+    }
+
+    /* Claims the valid buffer for reporting (without calling report()) */
+    Buf *report_buf()
+    {
+        if constexpr (DELTA) {
+            /* ask accum() to publish the delta for the next report */
+            m_delta.wanted.store(true, std::memory_order_relaxed);
+        }
+
+        uint8_t state = m_state.load(ANY);
 
         /* Must not already be reporting. */
         assert(state != REPORT_EMPTY && state != REPORT_ACCUM &&
@@ -210,38 +618,302 @@ public:
         while (state == VALID_EMPTY || state == VALID_ACCUM ||
                state == EMPTY_VALID || state == ACCUM_VALID) {
 
-            if (!m_state.compare_exchange_strong(state, state + 2)) {
+            if (!m_state.compare_exchange_strong(state, state + 2, ACQUIRE,
+                                                 ANY)) {
                 continue;
             }
 
             uint8_t valid_idx = (state >> 3);
-            return &m_bufs[valid_idx].report();
+            count(&stat_counters::report_hit);
+            return &m_bufs[valid_idx];
         }
 
         /* No valid buffer - return null */
+        count(&stat_counters::report_miss);
         return nullptr;
     }
+};
 
-    void reset()
+/*
+ * Multi-producer variant of lockfree_accum. Each producer thread claims
+ * its own shard (a separate lockfree_accum), so producers never contend
+ * with each other. report() collects the valid buffers from all shards
+ * and merges them into a separate buffer, which requires Buf to also
+ * implement:
+ *
+ *   void merge(const Buf &b);
+ *
+ * where merge() adds the contents of another buffer into this one.
+ *
+ * At most MaxProducers producers may exist at once. A producer is not
+ * tied to a thread, but only one thread may use it at a time. Data
+ * accumulated through a producer is still reported after the producer
+ * is destroyed (and its shard may then be claimed by a new producer).
+ */
+template<class Buf, class Val, int MaxProducers = 32, unsigned Flags = 0>
+class sharded_accum
+{
+private:
+    /* each shard on its own cache line(s) to prevent false sharing */
+    struct alignas(LFA_CACHE_LINE) shard {
+        lockfree_accum<Buf, Val, Flags> accum;
+        std::atomic_bool claimed = false;
+    };
+
+    shard m_shards[MaxProducers];
+
+    Buf m_merged{};
+    bool m_reporting = false;
+
+public:
+    class producer
+    {
+    public:
+        friend sharded_accum;
+
+        producer(producer &&p) : m_shard(p.m_shard) { p.m_shard = nullptr; }
+
+        ~producer()
+        {
+            if (m_shard) {
+                m_shard->accum.flush();
+                m_shard->claimed = false;
+            }
+        }
+
+        // not copyable (only one owner per shard)
+        producer(const producer &) = delete;
+        producer &operator=(const producer &) = delete;
+
+        void accum(const Val &val) { m_shard->accum.accum(val); }
+
+        template<class It>
+        void accum_batch(It first, It last)
+        {
+            m_shard->accum.accum_batch(first, last);
+        }
+
+        void flush() { m_shard->accum.flush(); }
+
+    private:
+        shard *m_shard;
+
+        explicit producer(shard &s) : m_shard(&s) {}
+    };
+
+    /* Claims an unused shard. May be called from any thread. */
+    producer get_producer()
+    {
+        for (auto &s : m_shards) {
+            if (!s.claimed.load() && !s.claimed.exchange(true)) {
+                return producer(s);
+            }
+        }
+
+        /* Too many producers */
+        assert(false);
+        abort();
+    }
+
+    const lfa_report_t<Buf> *report()
     {
-        uint8_t state = m_state.load();
+        /* Must not already be reporting. */
+        assert(!m_reporting);
+
+        bool valid = false;
+        for (auto &s : m_shards) {
+            Buf *buf = s.accum.report_buf();
+            if (buf) {
+                if (!valid) {
+                    m_merged.reset();
+                    valid = true;
+                }
+                m_merged.merge(*buf);
+                s.accum.reset();
+            }
+        }
+
+        if (!valid) {
+            return nullptr;
+        }
 
+        m_reporting = true;
+        return &m_merged.report();
+    }
+
+    /* Sum of shard stats. Requires LFA_STATS. */
+    lockfree_accum_stats stats() const
+    {
+        lockfree_accum_stats total{};
+        for (auto &s : m_shards) {
+            lockfree_accum_stats st = s.accum.stats();
+            total.direct += st.direct;
+            total.copy += st.copy;
+            total.discard += st.discard;
+            total.fresh += st.fresh;
+            total.report_hit += st.report_hit;
+            total.report_miss += st.report_miss;
+        }
+        return total;
+    }
+
+    void reset()
+    {
         /* Must be reporting. */
-        assert(state == REPORT_EMPTY || state == REPORT_ACCUM ||
-               state == REPORT_VALID || state == EMPTY_REPORT ||
-               state == ACCUM_REPORT || state == VALID_REPORT);
+        assert(m_reporting);
 
-        /*
-         * Just reset the state, accum() will reset the buffer later.
-         *
-         * Transition table:
-         *   REPORT_EMPTY(4)  -> EMPTY_EMPTY_ALT(8)
-         *   REPORT_ACCUM(5)  -> EMPTY_ACCUM(9)
-         *   REPORT_VALID(6)  -> EMPTY_VALID(10)
-         *   EMPTY_REPORT(12) -> EMPTY_EMPTY(0)
-         *   ACCUM_REPORT(13) -> ACCUM_EMPTY(1)
-         *   VALID_REPORT(14) -> VALID_EMPTY(2)
-         */
-        m_state ^= 12;
+        m_merged.reset();
+        m_reporting = false;
+    }
+};
+
+/*
+ * Copies a seqlock_accum buffer that accum() may be modifying. Not
+ * inlined, so that ThreadSanitizer reports show it as a frame (and the
+ * race can be suppressed by name).
+ */
+__attribute__((noinline)) static inline void
+lfa_seqlock_copy(void *dst, const void *src, size_t size)
+{
+    memcpy(dst, src, size);
+}
+
+/*
+ * Read-mostly alternative to lockfree_accum, based on a sequence lock.
+ * One thread accumulates directly into a single buffer, while any
+ * number of threads may take a snapshot of it at any time. A reader
+ * that overlaps with an accum() sees the sequence number change and
+ * retries, so readers never hold up the accumulating thread (and no
+ * buffer is ever copied on the accum() side).
+ *
+ * Unlike lockfree_accum, taking a snapshot does not consume anything:
+ * each snapshot contains everything accumulated since the last clear()
+ * (which is called by the accumulating thread). Buf must be trivially
+ * copyable, since readers copy it while it may be modified; torn
+ * copies are detected and discarded, and Buf::report() is then called
+ * on the reader's private copy.
+ *
+ * A copy takes time proportional to sizeof(Buf). With a large buffer
+ * (such as a histogram of many KiB) and an accumulating thread that
+ * calls accum() more often than a copy takes, every copy may overlap
+ * an accum(), so snapshot() can retry indefinitely. try_snapshot()
+ * bounds the number of attempts instead, leaving the fallback (e.g.
+ * reusing the previous snapshot, or trying again later) to the caller.
+ *
+ * Note for ThreadSanitizer: the reader's copy is still a data race by
+ * the letter of the memory model, since accum() modifies Buf in place
+ * with plain stores (so the copy cannot be made with atomic loads),
+ * and TSan reports it. The copy is made by lfa_seqlock_copy() alone,
+ * so that the race can be suppressed without hiding others, as with
+ * the tsan.supp file next to this header:
+ *
+ *   TSAN_OPTIONS="suppressions=tsan.supp history_size=7" ./program
+ *
+ * (A larger history_size keeps the reader's stack available when the
+ * writer's access is the one reported.)
+ *
+ * Under TSan, seqlock_accum does not compile unless the build also
+ * defines LFA_SEQLOCK_TSAN_SUPPRESSED, to confirm that the suppression
+ * is loaded (see the tsan target in the Makefile).
+ */
+template<class Buf, class Val>
+class seqlock_accum
+{
+    static_assert(std::is_trivially_copyable_v<Buf>,
+                  "seqlock_accum requires a trivially copyable Buf");
+#if defined(LFA_TSAN) && !defined(LFA_SEQLOCK_TSAN_SUPPRESSED)
+    static_assert(sizeof(Buf) == 0, "seqlock_accum races by design under "
+                                    "TSan; see the note above");
+#endif
+
+public:
+    void accum(const Val &val)
+    {
+        write([&](Buf &buf) { buf.accum(val); });
+    }
+
+    template<class It>
+    void accum_batch(It first, It last)
+    {
+        write([&](Buf &buf) {
+            if constexpr (lfa_has_accum_range<Buf, It>::value) {
+                buf.accum_range(first, last);
+            } else {
+                for (It it = first; it != last; ++it) {
+                    buf.accum(*it);
+                }
+            }
+        });
+    }
+
+    /* Must be called from the accumulating thread */
+    void clear()
+    {
+        write([](Buf &buf) { buf.reset(); });
+    }
+
+    /*
+     * Copies a consistent snapshot, making at most tries attempts.
+     * Returns false (leaving snap unspecified) if each one overlapped
+     * an accum(). May be called from any thread.
+     */
+    bool try_snapshot(Buf &snap, unsigned tries) const
+    {
+        for (; tries; tries--) {
+            uint32_t seq = m_seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                /* accum() in progress */
+                std::this_thread::yield();
+                continue;
+            }
+
+            /*
+             * Strictly speaking this races with accum() (see the TSan
+             * note above), but any copy made during an accum() is
+             * thrown away below.
+             */
+            lfa_seqlock_copy(&snap, &m_buf, sizeof(Buf));
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_seq.load(std::memory_order_relaxed) == seq) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     * Copies a consistent snapshot, retrying as long as necessary (see
+     * above). May be called from any thread.
+     */
+    void snapshot(Buf &snap) const
+    {
+        while (!try_snapshot(snap, UINT_MAX)) {
+        }
+    }
+
+    Buf snapshot() const
+    {
+        Buf snap;
+        snapshot(snap);
+        return snap;
+    }
+
+private:
+    /* odd while accum() is modifying the buffer */
+    alignas(LFA_CACHE_LINE) std::atomic_uint32_t m_seq = 0;
+
+    Buf m_buf{};
+
+    template<class F>
+    void write(const F &apply)
+    {
+        uint32_t seq = m_seq.load(std::memory_order_relaxed);
+        m_seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        apply(m_buf);
+
+        m_seq.store(seq + 2, std::memory_order_release);
     }
 };
@@ -0,0 +1,248 @@
+/*
+ * pool.h
+ * Copyright 2025 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include "refptr.h"
+#include <stddef.h>
+#include <mutex>
+#include <new>
+
+/*
+ * Free list of fixed-size memory blocks, used to avoid going through
+ * the general allocator for short-lived objects.
+ *
+ * Each thread keeps a small cache of free blocks, so alloc() and
+ * release() normally do not take any lock. Blocks are moved between
+ * the thread caches and a shared (mutex-protected) list in batches.
+ * A block may be released from a different thread than allocated it.
+ * Blocks are never returned to the system until exit.
+ *
+ * There is one global free list per block size; a block_pool is just
+ * a handle to it (all members are static).
+ */
+template<size_t Size>
+class block_pool
+{
+private:
+    struct block {
+        block *next;
+    };
+
+public:
+    static constexpr size_t block_size =
+        (Size > sizeof(block)) ? Size : sizeof(block);
+
+    static constexpr int CACHE_MAX = 64; // max blocks per thread cache
+    static constexpr int BATCH = 32;     // blocks moved to/from shared list
+
+    static void *alloc()
+    {
+        auto &cache = local();
+        if (!cache.head) {
+            refill(cache);
+        }
+
+        block *b = cache.head;
+        cache.head = b->next;
+        cache.count--;
+        return b;
+    }
+
+    static void release(void *ptr)
+    {
+        auto &cache = local();
+        block *b = static_cast<block *>(ptr);
+        b->next = cache.head;
+        cache.head = b;
+        if (++cache.count > CACHE_MAX) {
+            spill(cache, BATCH);
+        }
+    }
+
+    // number of free blocks in the calling thread's cache
+    static int cached() { return local().count; }
+
+private:
+    struct shared_list {
+        std::mutex mutex;
+        block *head = nullptr;
+
+        ~shared_list()
+        {
+            while (head) {
+                block *b = head;
+                head = b->next;
+                ::operator delete(b);
+            }
+        }
+    };
+
+    struct local_cache {
+        block *head = nullptr;
+        int count = 0;
+
+        ~local_cache() { spill(*this, count); }
+    };
+
+    static shared_list &shared()
+    {
+        static shared_list list;
+        return list;
+    }
+
+    static local_cache &local()
+    {
+        // make sure the shared list outlives all thread caches
+        static shared_list &list = shared();
+        (void)list;
+
+        static thread_local local_cache cache;
+        return cache;
+    }
+
+    // takes a batch of blocks from the shared list, or allocates a
+    // batch (outside the lock) if it is empty, so that a thread which
+    // is allocating more than it releases takes the lock only once per
+    // batch
+    static void refill(local_cache &cache)
+    {
+        auto &list = shared();
+        {
+            std::lock_guard<std::mutex> lock(list.mutex);
+            while (list.head && cache.count < BATCH) {
+                block *b = list.head;
+                list.head = b->next;
+                b->next = cache.head;
+                cache.head = b;
+                cache.count++;
+            }
+        }
+
+        if (!cache.head) {
+            for (; cache.count < BATCH; cache.count++) {
+                block *b = static_cast<block *>(::operator new(block_size));
+                b->next = cache.head;
+                cache.head = b;
+            }
+        }
+    }
+
+    // returns n blocks from the cache to the shared list
+    static void spill(local_cache &cache, int n)
+    {
+        if (!n) {
+            return;
+        }
+
+        block *first = cache.head, *last = first;
+        for (int i = 1; i < n; i++) {
+            last = last->next;
+        }
+        cache.head = last->next;
+        cache.count -= n;
+
+        auto &list = shared();
+        std::lock_guard<std::mutex> lock(list.mutex);
+        last->next = list.head;
+        list.head = first;
+    }
+};
+
+/* Pool for objects of type T (shared by types of the same size class) */
+template<typename T>
+using size_class_pool = block_pool<(sizeof(T) + 15) / 16 * 16>;
+
+/*
+ * Like make_ref(), but allocates the object from the pool it will be
+ * returned to, i.e. Pool<T> for T derived from ref_pooled<T, Pool> or
+ * ref_pooled_mt<T, Pool>.
+ */
+template<typename T, typename... Args>
+ref<T> make_ref_in(Args &&...args)
+{
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__,
+                  "over-aligned types are not supported");
+    // global placement new, since T's own operator new is deleted
+    return ref(*::new (T::pool_alloc()) T(std::forward<Args>(args)...));
+}
+
+/*
+ * Specialization where last_unref() destroys the object and returns it
+ * to a pool (by default, size_class_pool<T>). The object must be
+ * created by make_ref_in(); new T is not allowed, and a T must not be
+ * created on the stack or as a member of another object either. Count
+ * is as for refcounted.
+ */
+template<typename T, template<typename> class Pool = size_class_pool,
+         typename Count = unsigned>
+class ref_pooled : public refcounted<T, Count>
+{
+public:
+    template<typename U, typename... Args>
+    friend ref<U> make_ref_in(Args &&...args);
+
+    static void *operator new(size_t) = delete;
+    static void *operator new[](size_t) = delete;
+
+    void last_unref()
+    {
+        T *obj = static_cast<T *>(this);
+        obj->~T();
+        Pool<T>::release(obj);
+    }
+
+private:
+    static void *pool_alloc()
+    {
+        static_assert(sizeof(T) <= Pool<T>::block_size,
+                      "pool too small for T");
+        return Pool<T>::alloc();
+    }
+};
+
+/* Thread-safe variant of the above */
+template<typename T, template<typename> class Pool = size_class_pool,
+         typename Count = unsigned>
+class ref_pooled_mt : public refcounted_mt<T, Count>
+{
+public:
+    template<typename U, typename... Args>
+    friend ref<U> make_ref_in(Args &&...args);
+
+    static void *operator new(size_t) = delete;
+    static void *operator new[](size_t) = delete;
+
+    void last_unref()
+    {
+        T *obj = static_cast<T *>(this);
+        obj->~T();
+        Pool<T>::release(obj);
+    }
+
+private:
+    static void *pool_alloc()
+    {
+        static_assert(sizeof(T) <= Pool<T>::block_size,
+                      "pool too small for T");
+        return Pool<T>::alloc();
+    }
+};
+
+#endif // POOL_H
@@ -23,15 +23,26 @@
 #include <assert.h>
 #include <limits.h>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
 #include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 /**
  * List of smart pointers, with fast append and prepend.
  * Behaves predictably if modified during iteration.
  *
- * Items are removed by setting pointers in the list to null. The list
- * is automatically compacted to remove nulls when no iterators exist.
+ * Items are stored in a single contiguous buffer, with headroom at
+ * both ends for appending and prepending. Items are removed by setting
+ * pointers in the list to null. The list is automatically compacted to
+ * remove nulls when no iterators exist. (By default, this happens
+ * whenever the last iterator is destroyed; see set_compaction().)
  *
  * Iterators behave as follows:
  *
@@ -44,26 +55,40 @@
  *
  * 3. Iterators automatically skip over null pointers.
  *
+ * If Indexed is true, the list also keeps a hash map from each item to
+ * its position, making remove() and contains() O(1). In that case, an
+ * item may be added to the list only once.
+ *
  * Some limitations:
  *
- * 1. Inserting items into the middle of the list is not directly
- *    supported. (It's possible to emulate insertion by removing and
- *    re-adding all the items after the insertion point.)
+ * 1. Inserting items into the middle of the list (insert_before())
+ *    shifts all the items on one side of the insertion point, and is
+ *    not possible while iterators exist.
  *
  * 2. None of the following may be called while any iterators exist:
  *      - ~reflist()
  *      - operator=()
  *      - clear()
+ *      - insert_before()
  *
- * 3. Currently, only non-const iterators are provided.
+ * Const iterators (const_iter) follow the same rules but give only
+ * const access to items, and cannot remove them. For read-only passes
+ * over the list, snapshot() returns a lighter-weight view which does
+ * not add references to items; the list must not be modified while a
+ * snapshot is being iterated. Destroying the last const iterator or
+ * snapshot does not compact the list (nulls are then removed after
+ * the next non-const iterator, or by compact()).
  */
-template<typename T, typename Ptr = refptr<T>>
-class reflist : public refcounted<reflist<T, Ptr>>
+template<typename T, typename Ptr = refptr<T>, bool Indexed = false>
+class reflist : public refcounted<reflist<T, Ptr, Indexed>>
 {
 public:
     friend ref_base<reflist>;
+    friend ref_base<const reflist>;
 
-    class iter
+    // iterator over a list of type L (reflist or const reflist)
+    template<typename L>
+    class basic_iter
     {
     public:
         friend reflist;
@@ -84,7 +109,7 @@ public:
         T &operator*() { return *get(); }
         T *operator->() { return get(); }
 
-        bool operator==(const iter &it)
+        bool operator==(const basic_iter &it)
         {
             // can't compare different lists or directions
             assert(m_list.get() == it.m_list.get() && m_dir == it.m_dir);
@@ -92,9 +117,9 @@ public:
             return m_idx == it.m_idx;
         }
 
-        bool operator!=(const iter &it) { return !operator==(it); }
+        bool operator!=(const basic_iter &it) { return !operator==(it); }
 
-        iter &operator++()
+        basic_iter &operator++()
         {
             m_val.reset();
             m_idx += m_dir;
@@ -102,7 +127,7 @@ public:
             return *this;
         }
 
-        iter &operator--()
+        basic_iter &operator--()
         {
             m_val.reset();
             m_idx -= m_dir;
@@ -110,22 +135,45 @@ public:
             return *this;
         }
 
+        // used by util::find_ptr(): advances to the first item equal
+        // to ptr (or to the end) by scanning the slots directly
+        void seek_ptr(const void *ptr)
+        {
+            if (m_dir > 0 && m_val && ptr) {
+                m_val.reset();
+                auto &list = *m_list;
+                int pos = list.find_raw(list.m_zero + m_idx,
+                                        list.m_zero + m_end, ptr);
+                m_idx = pos - list.m_zero;
+                if (m_idx < m_end) {
+                    m_val.reset(list.at(m_idx).get());
+                } else {
+                    m_idx = INT_MAX - 1; // see find_valid()
+                }
+            } else {
+                while (m_val && m_val.get() != ptr) {
+                    operator++();
+                }
+            }
+        }
+
         Ptr remove()
         {
             if (m_val) {
+                m_list->guard_removed(m_val.get());
                 m_val.reset(); // release ref
-                return std::move(m_list->at(m_idx));
+                return m_list->take(m_idx);
             } else {
                 return Ptr();
             }
         }
 
     private:
-        ref<reflist> m_list;
+        ref<L> m_list;
         int m_start, m_end, m_idx, m_dir;
         refptr<T> m_val; // not ownptr (if Ptr = ownptr)
 
-        iter(reflist &list, int idx, int dir)
+        basic_iter(L &list, int idx, int dir)
             : m_list(list), m_start(list.start_idx()), m_end(list.end_idx()),
               m_idx(idx), m_dir(dir)
         {
@@ -162,6 +210,8 @@ public:
         }
     };
 
+    using iter = basic_iter<reflist>;
+
     class reverse_view
     {
     public:
@@ -176,28 +226,157 @@ public:
         reverse_view(reflist &list) : m_list(list) {}
     };
 
+    class const_iter
+    {
+    public:
+        friend reflist;
+
+        // std::iterator_traits
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = const T;
+        using difference_type = int;
+        using pointer = const T *;
+        using reference = const T &;
+
+        explicit operator bool() { return (bool)m_it; }
+
+        const T *get() { return m_it.get(); }
+
+        const T &operator*() { return *get(); }
+        const T *operator->() { return get(); }
+
+        bool operator==(const const_iter &it) { return m_it == it.m_it; }
+        bool operator!=(const const_iter &it) { return m_it != it.m_it; }
+
+        const_iter &operator++()
+        {
+            ++m_it;
+            return *this;
+        }
+
+        const_iter &operator--()
+        {
+            --m_it;
+            return *this;
+        }
+
+        void seek_ptr(const void *ptr) { m_it.seek_ptr(ptr); }
+
+    private:
+        basic_iter<const reflist> m_it;
+
+        const_iter(basic_iter<const reflist> &&it) : m_it(std::move(it)) {}
+    };
+
+    class snapshot_view
+    {
+    public:
+        friend reflist;
+
+        class iterator
+        {
+        public:
+            friend snapshot_view;
+
+            const T &operator*() const { return *operator->(); }
+            const T *operator->() const { return m_list->at(m_idx).get(); }
+
+            bool operator!=(const iterator &it) const
+            {
+                return m_idx != it.m_idx;
+            }
+
+            iterator &operator++()
+            {
+                m_idx++;
+                skip_nulls();
+                return *this;
+            }
+
+        private:
+            const reflist *m_list;
+            int m_idx, m_end;
+
+            iterator(const reflist *list, int idx, int end)
+                : m_list(list), m_idx(idx), m_end(end)
+            {
+                skip_nulls();
+            }
+
+            void skip_nulls()
+            {
+                while (m_idx < m_end && !m_list->at(m_idx)) {
+                    m_idx++;
+                }
+            }
+        };
+
+        iterator begin() const
+        {
+            return iterator(m_list.get(), m_start, m_end);
+        }
+
+        iterator end() const { return iterator(m_list.get(), m_end, m_end); }
+
+    private:
+        ref<const reflist> m_list; // prevents compaction
+        int m_start, m_end;
+
+        snapshot_view(const reflist &list)
+            : m_list(list), m_start(list.start_idx()), m_end(list.end_idx())
+        {
+        }
+    };
+
     reflist() {}
 
     // this produces a compacted copy (nulls omitted)
-    reflist(const reflist &list) { append_all(list); }
+    reflist(const reflist &list)
+        : m_null_ratio(list.m_null_ratio), m_chunk(list.m_chunk)
+    {
+        append_all(list);
+    }
 
     reflist(reflist &&list)
+        : m_items(std::move(list.m_items)), m_first(list.m_first),
+          m_last(list.m_last), m_zero(list.m_zero),
+          m_count(list.m_count), m_index(std::move(list.m_index)),
+          m_compacting(list.m_compacting), m_read(list.m_read),
+          m_write(list.m_write), m_null_ratio(list.m_null_ratio),
+          m_chunk(list.m_chunk)
     {
         assert(list.refcount() == 0);
-        m_fwd_items = std::move(list.m_fwd_items);
-        m_rev_items = std::move(list.m_rev_items);
-        m_cached_size = list.m_cached_size;
-        list.m_cached_size = 0;
+        list.m_compacting = false;
+        list.m_items.clear();
+        list.m_first = list.m_last = list.m_zero = 0;
+        list.m_count = 0;
+        list.m_index = index_map();
     }
 
+    // reuses this list's storage
     reflist &operator=(const reflist &list)
     {
-        return util::reconstruct(*this, list);
+        if (&list != this) {
+            clear();
+            m_null_ratio = list.m_null_ratio;
+            m_chunk = list.m_chunk;
+            append_all(list);
+        }
+        return *this;
     }
 
+    // exchanges storage, so that the source list keeps this list's
+    // (now empty) buffer for reuse
     reflist &operator=(reflist &&list)
     {
-        return util::reconstruct(*this, std::move(list));
+        if (&list != this) {
+            assert(list.refcount() == 0);
+            clear();
+            swap_storage(list);
+            std::swap(m_null_ratio, list.m_null_ratio);
+            std::swap(m_chunk, list.m_chunk);
+        }
+        return *this;
     }
 
     iter begin() { return iter(*this, start_idx(), 1); }
@@ -212,57 +391,605 @@ public:
 
     reverse_view reversed() { return reverse_view(*this); }
 
-    bool empty() { return !begin(); }
-    int size() { return std::distance(begin(), end()); }
+    const_iter cbegin() const
+    {
+        return basic_iter<const reflist>(*this, start_idx(), 1);
+    }
+
+    const_iter cend() const
+    {
+        return basic_iter<const reflist>(*this, end_idx(), 1);
+    }
+
+    const_iter begin() const { return cbegin(); }
+    const_iter end() const { return cend(); }
+
+    snapshot_view snapshot() const { return snapshot_view(*this); }
 
-    void clear() { *this = reflist(); }
+    bool empty() const { return !m_count; }
+    int size() const { return m_count; }
+
+    // keeps the allocated storage
+    void clear()
+    {
+        assert(this->refcount() == 0);
+        for (int pos = m_first; pos < m_last; pos++) {
+            m_items[pos] = Ptr();
+        }
+        m_first = m_last = m_zero = 0;
+        m_count = 0;
+        m_index = index_map();
+        m_compacting = false;
+    }
 
     template<typename P>
     void append(P &&ptr)
     {
-        m_fwd_items.emplace_back(std::forward<P>(ptr));
+        make_room(0, 1);
+        m_items[m_last] = Ptr(std::forward<P>(ptr));
+        added(m_last++);
     }
 
     void append_all(const reflist &list)
     {
-        auto &list_ = const_cast<reflist &>(list);
-        for (auto it = list_.begin(); it; ++it) {
-            m_fwd_items.emplace_back(it.get());
+        make_room(0, list.size());
+        // reads the slots directly, without an iterator's references;
+        // note that the list may be this list, so the range is fixed
+        int first = list.m_first, last = list.m_last;
+        for (int pos = first; pos < last; pos++) {
+            // the items themselves are shared, so not const here
+            if (T *item = list.m_items[pos].get()) {
+                append(item);
+            }
+        }
+    }
+
+    // moves all items from another list (which must have no iterators)
+    void append_all(reflist &&list)
+    {
+        assert(list.refcount() == 0);
+        if (this->refcount() == 0 && m_first == m_last) {
+            // take storage, but keep this list's compaction policy
+            clear();
+            swap_storage(list);
+            return;
+        }
+
+        make_room(0, list.m_count);
+        for (int pos = list.m_first; pos < list.m_last; pos++) {
+            if (list.m_items[pos]) {
+                m_items[m_last] = std::move(list.m_items[pos]);
+                added(m_last++);
+            }
+        }
+        list.clear();
+    }
+
+    // appends the items in [first, last), in order
+    template<typename It>
+    void append_range(It first, It last)
+    {
+        if constexpr (is_forward<It>) {
+            make_room(0, std::distance(first, last));
+        }
+        for (; first != last; ++first) {
+            append(*first);
+        }
+    }
+
+    // prepends the items in [first, last), keeping them in order
+    template<typename It>
+    void prepend_range(It first, It last)
+    {
+        if constexpr (is_forward<It>) {
+            int count = std::distance(first, last);
+            make_room(count, 0);
+            int pos = m_first -= count;
+            for (; first != last; ++first, ++pos) {
+                m_items[pos] = Ptr(*first);
+                added(pos);
+            }
+        } else {
+            std::vector<Ptr> items;
+            for (; first != last; ++first) {
+                items.emplace_back(*first);
+            }
+            prepend_range(std::make_move_iterator(items.begin()),
+                          std::make_move_iterator(items.end()));
+        }
+    }
+
+    /*
+     * Controls the compaction done when the last iterator is
+     * destroyed. Compaction starts only once more than null_ratio of
+     * the slots in use are null, and then visits at most chunk slots
+     * each time (0 = no limit), resuming after the next iterator is
+     * destroyed. The default is to compact fully if there are any
+     * nulls.
+     */
+    void set_compaction(float null_ratio, int chunk = 0)
+    {
+        m_null_ratio = null_ratio;
+        m_chunk = chunk;
+    }
+
+    float compaction_ratio() const { return m_null_ratio; }
+    int compaction_chunk() const { return m_chunk; }
+
+    // fully compacts the list now (e.g. while idle)
+    void compact()
+    {
+        assert(this->refcount() == 0);
+        if (m_last - m_first > m_count) {
+            compact_step(0);
+        }
+    }
+
+    // ensures room for adding items without reallocating
+    void reserve(int front, int back)
+    {
+        front = std::max(front - m_first, 0);
+        back = std::max(back - ((int)m_items.size() - m_last), 0);
+        if (front || back) {
+            grow(front, back);
         }
     }
 
     template<typename P>
     void prepend(P &&ptr)
     {
-        m_rev_items.emplace_back(std::forward<P>(ptr));
+        make_room(1, 0);
+        m_items[--m_first] = Ptr(std::forward<P>(ptr));
+        added(m_first);
+    }
+
+    /*
+     * Inserts ptr just before the item "before", moving the items
+     * either before or after the insertion point (whichever are
+     * fewer) by one slot. Returns false if "before" is not found.
+     */
+    template<typename B, typename P>
+    bool insert_before(const B &before, P &&ptr)
+    {
+        assert(this->refcount() == 0); // see limitations above
+        if (m_compacting) {
+            compact(); // moving items would confuse the cursors
+        }
+        int idx = find_idx(before);
+        if (idx == NOT_FOUND) {
+            return false;
+        }
+
+        int pos;
+        if (idx - start_idx() < end_idx() - idx) {
+            make_room(1, 0);
+            pos = m_zero + idx - 1;
+            for (int p = --m_first; p < pos; p++) {
+                m_items[p] = std::move(m_items[p + 1]);
+                reindex(p);
+            }
+        } else {
+            make_room(0, 1);
+            pos = m_zero + idx;
+            for (int p = m_last++; p > pos; p--) {
+                m_items[p] = std::move(m_items[p - 1]);
+                reindex(p);
+            }
+        }
+
+        m_items[pos] = Ptr(std::forward<P>(ptr));
+        added(pos);
+        return true;
+    }
+
+    /*
+     * Calls func(T &) for each item. Follows the same rules as
+     * iterating from begin() to end(), but adds a reference only to
+     * the list (once) rather than to each item visited. The current
+     * item is guarded only if it's removed during the callback.
+     */
+    template<typename F>
+    void for_each_fast(F &&func)
+    {
+        ref<reflist> pin(*this);
+        fast_frame frame(*this);
+        int end = end_idx();
+        for (int idx = start_idx(); idx < end; idx++) {
+            frame.cur = at(idx).get();
+            if (frame.cur) {
+                func(*frame.cur);
+                frame.guard.reset();
+            }
+        }
+    }
+
+    /*
+     * Calls func(T &) for each item in parallel. The range [start,
+     * end) is split into chunks of the given number of slots, which
+     * are claimed by tasks (std::function<void()>) passed to exec(),
+     * e.g. to queue them on a thread pool, and by the calling thread.
+     * Returns once all the chunks are done.
+     *
+     * If func (or exec) throws, the remaining chunks are skipped, and
+     * the first exception is rethrown from the calling thread once no
+     * task is still running func.
+     *
+     * The list is pinned only once (from the calling thread), and no
+     * references to items are added, so items need not be refcounted
+     * thread-safely. In turn, neither the list nor its items may be
+     * modified until this returns.
+     */
+    template<typename Exec, typename F>
+    void parallel_for_each(Exec &&exec, const F &func, int chunk = 256)
+    {
+        assert(chunk > 0);
+        ref<reflist> pin(*this);
+        int start = start_idx(), end = end_idx();
+        int chunks = (end - start + chunk - 1) / chunk;
+
+        // shared with the tasks, which may outlive this call (but
+        // won't touch the list after the last chunk is claimed)
+        struct state {
+            std::atomic<int> next = 0;
+            std::atomic<bool> failed = false;
+            int chunks, done = 0;
+            std::exception_ptr error; // the first one thrown
+            std::mutex mutex;
+            std::condition_variable finished;
+            std::function<void(int)> run_chunk;
+
+            // after a failure, chunks are still claimed (so that they
+            // are counted as done) but skipped
+            void run()
+            {
+                int count = 0;
+                for (int c; (c = next.fetch_add(1)) < chunks; count++) {
+                    if (failed.load(std::memory_order_relaxed)) {
+                        continue;
+                    }
+                    try {
+                        run_chunk(c);
+                    } catch (...) {
+                        fail(std::current_exception());
+                    }
+                }
+                if (count) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if ((done += count) == chunks) {
+                        finished.notify_all();
+                    }
+                }
+            }
+
+            void fail(std::exception_ptr e)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::move(e);
+                }
+                failed = true;
+            }
+        };
+
+        auto shared = std::make_shared<state>();
+        shared->chunks = chunks;
+        shared->run_chunk = [this, &func, start, end, chunk](int c) {
+            int stop = std::min(start + (c + 1) * chunk, end);
+            for (int idx = start + c * chunk; idx < stop; idx++) {
+                if (T *item = at(idx).get()) {
+                    func(*item);
+                }
+            }
+        };
+
+        unsigned threads = std::max(std::thread::hardware_concurrency(), 2u);
+        int tasks = std::min(chunks - 1, (int)threads - 1);
+        try {
+            for (int i = 0; i < tasks; i++) {
+                exec(std::function<void()>([shared]() { shared->run(); }));
+            }
+        } catch (...) {
+            // the chunks are then done (or skipped) below
+            shared->fail(std::current_exception());
+        }
+
+        shared->run();
+        std::unique_lock<std::mutex> lock(shared->mutex);
+        shared->finished.wait(lock,
+                              [&]() { return shared->done == chunks; });
+        if (shared->error) {
+            std::rethrow_exception(shared->error);
+        }
     }
 
     template<typename P>
     bool remove(const P &ptr)
     {
-        return (bool)util::find_ptr(begin(), ptr).remove();
+        if constexpr (Indexed) {
+            int idx = find_idx(ptr);
+            if (idx == NOT_FOUND) {
+                return false;
+            }
+            guard_removed(at(idx).get());
+            take(idx);
+            // compaction must be amortized to keep removal O(1)
+            if (this->refcount() == 0 && m_last - m_first > 2 * m_count) {
+                compact_step(m_chunk);
+            }
+            return true;
+        } else {
+            return (bool)util::find_ptr(begin(), ptr).remove();
+        }
+    }
+
+    template<typename P>
+    bool contains(const P &ptr) const
+    {
+        return find_idx(ptr) != NOT_FOUND;
     }
 
 private:
-    std::vector<Ptr> m_fwd_items;
-    std::vector<Ptr> m_rev_items; // in reverse order
-    int m_cached_size = 0;
+    static constexpr int MIN_GROW = 4;
+    static constexpr int NOT_FOUND = INT_MIN;
+
+    template<typename It>
+    static constexpr bool is_forward = std::is_base_of_v<
+        std::forward_iterator_tag,
+        typename std::iterator_traits<It>::iterator_category>;
+
+    struct no_index {
+    };
+
+    using index_map = std::conditional_t<Indexed,
+        std::unordered_map<const T *, int>, no_index>;
 
-    int start_idx() { return -(int)m_rev_items.size(); }
-    int end_idx() { return m_fwd_items.size(); }
+    // current item of each active for_each_fast() call (innermost first)
+    struct fast_frame {
+        reflist &list;
+        fast_frame *prev;
+        T *cur = nullptr;
+        refptr<T> guard; // set only if cur is removed
+
+        fast_frame(reflist &list) : list(list), prev(list.m_frames)
+        {
+            list.m_frames = this;
+        }
+
+        ~fast_frame() { list.m_frames = prev; }
+    };
+
+    // items are in m_items[m_first, m_last); slots outside that range
+    // are always null. Index 0 (as seen by iterators) is at m_zero,
+    // which shifts when the buffer is regrown at the front, so that
+    // existing iterators remain valid.
+    std::vector<Ptr> m_items;
+    int m_first = 0, m_last = 0, m_zero = 0;
+    int m_count = 0; // non-null items
+    fast_frame *m_frames = nullptr;
+    index_map m_index; // item -> (iterator) index, if Indexed
+
+    // incremental compaction: [m_write, m_read) is null and
+    // [m_read, m_last) is not yet visited
+    bool m_compacting = false;
+    int m_read = 0, m_write = 0;
+    float m_null_ratio = 0;
+    int m_chunk = 0;
+
+    // exchanges items and compaction progress (but not policy)
+    void swap_storage(reflist &list)
+    {
+        std::swap(m_items, list.m_items);
+        std::swap(m_first, list.m_first);
+        std::swap(m_last, list.m_last);
+        std::swap(m_zero, list.m_zero);
+        std::swap(m_count, list.m_count);
+        std::swap(m_index, list.m_index);
+        std::swap(m_compacting, list.m_compacting);
+        std::swap(m_read, list.m_read);
+        std::swap(m_write, list.m_write);
+    }
+
+    int start_idx() const { return m_first - m_zero; }
+    int end_idx() const { return m_last - m_zero; }
 
     Ptr &at(int idx)
     {
-        return (idx >= 0) ? m_fwd_items.at(idx) : m_rev_items.at(-1 - idx);
+        assert(idx >= start_idx() && idx < end_idx());
+        return m_items[m_zero + idx];
+    }
+
+    const Ptr &at(int idx) const
+    {
+        assert(idx >= start_idx() && idx < end_idx());
+        return m_items[m_zero + idx];
+    }
+
+    template<typename P>
+    static const T *raw_ptr(const P &ptr)
+    {
+        if constexpr (std::is_convertible_v<const P &, const T *>) {
+            return ptr;
+        } else {
+            return ptr.get();
+        }
+    }
+
+    template<typename P>
+    int find_idx(const P &ptr) const
+    {
+        const T *raw = raw_ptr(ptr);
+        if (!raw) {
+            return NOT_FOUND;
+        }
+        if constexpr (Indexed) {
+            auto found = m_index.find(raw);
+            return (found != m_index.end()) ? found->second : NOT_FOUND;
+        } else {
+            int pos = find_raw(m_first, m_last, raw);
+            return (pos < m_last) ? pos - m_zero : NOT_FOUND;
+        }
+    }
+
+    // returns the position of ptr in m_items[first, last) (or last)
+    int find_raw(int first, int last, const void *ptr) const
+    {
+        if constexpr (sizeof(Ptr) == sizeof(void *) &&
+                      util::is_trivially_relocatable<Ptr>::value) {
+            auto raw = reinterpret_cast<void *const *>(m_items.data());
+            return util::find_raw_ptr(raw, first, last, ptr);
+        } else {
+            for (int pos = first; pos < last; pos++) {
+                if (m_items[pos].get() == ptr) {
+                    return pos;
+                }
+            }
+            return last;
+        }
+    }
+
+    // updates the count and index after storing an item at pos
+    void added(int pos)
+    {
+        if (auto item = m_items[pos].get()) {
+            m_count++;
+            if constexpr (Indexed) {
+                [[maybe_unused]] bool is_new =
+                    m_index.emplace(item, pos - m_zero).second;
+                assert(is_new); // must not be added twice
+            }
+        }
+    }
+
+    // updates the index after moving an item to pos
+    void reindex(int pos)
+    {
+        if constexpr (Indexed) {
+            if (auto item = m_items[pos].get()) {
+                m_index[item] = pos - m_zero;
+            }
+        }
+    }
+
+    Ptr take(int idx)
+    {
+        Ptr ptr = std::move(at(idx));
+        if (ptr) {
+            m_count--;
+            if constexpr (Indexed) {
+                m_index.erase(ptr.get());
+            }
+        }
+        return ptr;
+    }
+
+    // keeps an item alive if for_each_fast() is currently visiting it
+    void guard_removed(T *item)
+    {
+        for (auto frame = m_frames; frame; frame = frame->prev) {
+            if (frame->cur == item && !frame->guard) {
+                frame->guard.reset(item);
+            }
+        }
+    }
+
+    // like reserve(), but grows geometrically to keep adding items
+    // amortized O(1)
+    void make_room(int front, int back)
+    {
+        int min_grow = std::max(m_last - m_first, MIN_GROW);
+        front = std::max(front - m_first, 0);
+        back = std::max(back - ((int)m_items.size() - m_last), 0);
+        if (front || back) {
+            grow(front ? std::max(front, min_grow) : 0,
+                 back ? std::max(back, min_grow) : 0);
+        }
+    }
+
+    // adds headroom (in slots) at the front and/or back
+    void grow(int front, int back)
+    {
+        std::vector<Ptr> items(front + m_items.size() + back);
+        for (int i = m_first; i < m_last; i++) {
+            items[front + i] = std::move(m_items[i]);
+        }
+        m_items = std::move(items);
+        m_first += front;
+        m_last += front;
+        m_zero += front;
+        m_read += front;
+        m_write += front;
     }
 
     void last_unref()
     {
-        // compact after last iter destroyed, if size changed
-        if (end_idx() - start_idx() > m_cached_size) {
-            util::remove(m_fwd_items, nullptr);
-            util::remove(m_rev_items, nullptr);
-            m_cached_size = end_idx() - start_idx();
+        // compact after last iter destroyed, if needed
+        int slots = m_last - m_first;
+        if (m_compacting || slots - m_count > m_null_ratio * slots) {
+            compact_step(m_chunk);
+        }
+    }
+
+    // releasing the last const iterator or snapshot does not compact,
+    // since the storage of a const list must not change
+    void last_unref() const {}
+
+    // compacts (at most budget slots, or all if 0); iterator indices
+    // are not renumbered, so the index only needs updating for items
+    // that are moved
+    void compact_step(int budget)
+    {
+        if (!budget) {
+            m_last = m_first + remove_nulls(m_first, m_last);
+            m_compacting = false;
+            assert(m_last - m_first == m_count);
+            if constexpr (Indexed) {
+                for (int pos = m_first; pos < m_last; pos++) {
+                    reindex(pos);
+                }
+            }
+            return;
+        }
+
+        if (!m_compacting) {
+            m_read = m_write = m_first;
+            m_compacting = true;
+        }
+
+        int stop = std::min(m_last, m_read + budget);
+        for (; m_read < stop; m_read++) {
+            if (m_items[m_read]) {
+                if (m_read != m_write) {
+                    m_items[m_write] = std::move(m_items[m_read]);
+                    reindex(m_write);
+                }
+                m_write++;
+            }
+        }
+
+        if (m_read == m_last) {
+            m_last = m_write;
+            m_compacting = false;
+        }
+    }
+
+    // packs non-null items in [first, last) towards first, leaving
+    // null slots behind; returns the number of non-null items
+    int remove_nulls(int first, int last)
+    {
+        if constexpr (sizeof(Ptr) == sizeof(void *) &&
+                      util::is_trivially_relocatable<Ptr>::value) {
+            // move the raw pointers (no refcount changes); the
+            // vacated slots are zeroed, i.e. null
+            auto raw = reinterpret_cast<void **>(m_items.data());
+            return util::compact_nulls(raw + first, last - first);
+        } else {
+            auto begin = m_items.begin() + first;
+            auto end = m_items.begin() + last;
+            auto new_end = std::remove(begin, end, nullptr);
+            for (auto it = new_end; it != end; ++it) {
+                *it = Ptr();
+            }
+            return new_end - begin;
         }
     }
 };
@@ -275,4 +1002,8 @@ private:
 template<typename T>
 using ownlist = reflist<T, ownptr<T>>;
 
+/* Variant with O(1) remove() and contains(); see above. */
+template<typename T, typename Ptr = refptr<T>>
+using indexed_reflist = reflist<T, Ptr, true>;
+
 #endif // REFLIST_H
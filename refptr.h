@@ -21,70 +21,149 @@
 
 #include "util.h"
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <limits>
+#include <thread>
+#include <type_traits>
 #include <utility>
 
-/* Generic owning pointer (similar to std::unique_ptr) */
-template<class T, void (*deleter)(T *) = nullptr>
-class ownptr
+template<typename T>
+class weakptr_mt;
+template<typename T>
+class weak_target_mt;
+
+/* Default deleter for ownptr (uses delete or delete[]) */
+template<class T>
+struct own_delete {
+    void operator()(T *ptr) const
+    {
+        (void)sizeof(*ptr);
+        delete ptr;
+    }
+};
+
+template<class T>
+struct own_delete<T[]> {
+    void operator()(T *ptr) const
+    {
+        (void)sizeof(*ptr);
+        delete[] ptr;
+    }
+};
+
+/* No-op deleter, e.g. for objects allocated from an arena */
+struct own_nodelete {
+    template<class T>
+    void operator()(T *) const
+    {
+    }
+};
+
+/*
+ * Generic owning pointer (similar to std::unique_ptr).
+ *
+ * The deleter can be given either as a plain function (deleter) or as
+ * a functor type (Deleter). A stateless functor is stored as an empty
+ * base, so it adds nothing to sizeof(ownptr). ownptr<T[]> owns an array
+ * allocated with new[].
+ */
+template<class T, void (*deleter)(std::remove_extent_t<T> *) = nullptr,
+         class Deleter = own_delete<T>>
+class ownptr : private Deleter
 {
 public:
-    using value_type = T;
+    using value_type = std::remove_extent_t<T>;
 
     ownptr() : m_ptr(nullptr) {}
-    ownptr(ownptr &&op) : m_ptr(op.m_ptr) { op.m_ptr = nullptr; }
+    ownptr(ownptr &&op) : Deleter(std::move(op)), m_ptr(op.m_ptr)
+    {
+        op.m_ptr = nullptr;
+    }
     ~ownptr() { reset(); }
 
-    explicit ownptr(T *ptr) : m_ptr(ptr) {}
+    explicit ownptr(value_type *ptr, const Deleter &del = Deleter())
+        : Deleter(del), m_ptr(ptr)
+    {
+    }
 
     ownptr &operator=(ownptr &&op)
     {
-        return util::reconstruct(*this, std::move(op));
+        if (&op != this) {
+            // op itself may be owned by our object, so take everything
+            // from it before reset() can destroy it
+            Deleter del = std::move(static_cast<Deleter &>(op));
+            value_type *ptr = op.m_ptr;
+            op.m_ptr = nullptr;
+            reset(ptr);
+            static_cast<Deleter &>(*this) = std::move(del);
+        }
+        return *this;
     }
 
     explicit operator bool() const { return (bool)m_ptr; }
 
-    bool operator==(T *ptr) const { return get() == ptr; }
+    bool operator==(value_type *ptr) const { return get() == ptr; }
     bool operator==(const ownptr &op) const { return get() == op.get(); }
-    bool operator!=(T *ptr) const { return get() != ptr; }
+    bool operator!=(value_type *ptr) const { return get() != ptr; }
     bool operator!=(const ownptr &op) const { return get() != op.get(); }
 
-    T *get() const { return m_ptr; }
+    value_type *get() const { return m_ptr; }
+
+    value_type &operator[](size_t idx) const
+    {
+        static_assert(std::is_array_v<T>, "operator[] requires ownptr<T[]>");
+        return m_ptr[idx];
+    }
 
     // safe usage pattern to prevent accidental null dereference
-    [[nodiscard]] bool check(T *&ptr) { return (bool)(ptr = get()); }
+    [[nodiscard]] bool check(value_type *&ptr) { return (bool)(ptr = get()); }
 
-    void reset(T *ptr = nullptr)
+    void reset(value_type *ptr = nullptr)
     {
         if (m_ptr) {
-            if constexpr (deleter) {
+            if constexpr (deleter != nullptr) {
                 deleter(m_ptr);
             } else {
-                (void)sizeof(*m_ptr);
-                delete m_ptr;
+                static_cast<Deleter &>(*this)(m_ptr);
             }
         }
         m_ptr = ptr;
     }
 
+    // for ownptr<T[]>, takes the number of (value-initialized) elements
     template<typename... Args>
-    T *set_new(Args &&...args)
+    value_type *set_new(Args &&...args)
     {
-        reset(new T{std::forward<Args>(args)...});
+        if constexpr (std::is_array_v<T>) {
+            static_assert(sizeof...(Args) == 1, "expected element count");
+            size_t count = ((size_t)args, ...);
+            reset(new value_type[count]{});
+        } else {
+            reset(new T{std::forward<Args>(args)...});
+        }
         return get();
     }
 
 private:
-    T *m_ptr;
+    value_type *m_ptr;
 };
 
-template<typename T>
-static inline bool operator==(T *ptr, const ownptr<T> &op)
+/* Shorthand for an ownptr with a functor deleter */
+template<class T, class Deleter>
+using ownptr_with = ownptr<T, nullptr, Deleter>;
+
+template<class T, void (*D)(std::remove_extent_t<T> *), class Del>
+static inline bool operator==(std::remove_extent_t<T> *ptr,
+                              const ownptr<T, D, Del> &op)
 {
     return op.operator==(ptr);
 }
 
-template<typename T>
-static inline bool operator!=(T *ptr, const ownptr<T> &op)
+template<class T, void (*D)(std::remove_extent_t<T> *), class Del>
+static inline bool operator!=(std::remove_extent_t<T> *ptr,
+                              const ownptr<T, D, Del> &op)
 {
     return op.operator!=(ptr);
 }
@@ -92,9 +171,10 @@ static inline bool operator!=(T *ptr, const ownptr<T> &op)
 /*
  * Common base for a counting reference (used by ref and refptr).
  *
- * The referenced type needs to inherit the "refcounted" mix-in and
- * implement a last_unref() function, which is called to perform
- * type-specific behavior when the reference count drops to zero.
+ * The referenced type needs to inherit the "refcounted" (or
+ * "refcounted_mt") mix-in and implement a last_unref() function, which
+ * is called to perform type-specific behavior when the reference count
+ * drops to zero.
  *
  * Shared-ownership semantics can be obtained by making last_unref()
  * delete the object, but other behaviors are possible too.
@@ -105,6 +185,8 @@ template<typename T>
 class ref_base
 {
 public:
+    friend weakptr_mt<T>;
+
     using value_type = T;
 
     ref_base() {}
@@ -112,14 +194,28 @@ public:
     ref_base(ref_base &&r) : m_ptr(r.m_ptr) { r.m_ptr = nullptr; }
     ~ref_base() { reset(); }
 
+    // reset() adds the new ref before dropping the old one, so this
+    // is safe for self-assignment (and a no-op for the same target)
     ref_base &operator=(const ref_base &r)
     {
-        return util::reconstruct(*this, r);
+        if (r.m_ptr != m_ptr) {
+            reset(r.m_ptr);
+        }
+        return *this;
     }
 
+    // moves the ref (no change to the new target's refcount)
     ref_base &operator=(ref_base &&r)
     {
-        return util::reconstruct(*this, std::move(r));
+        if (&r != this) {
+            T *old = m_ptr;
+            m_ptr = r.m_ptr;
+            r.m_ptr = nullptr;
+            if (old && old->drop_ref()) {
+                old->last_unref();
+            }
+        }
+        return *this;
     }
 
     T *get() const { return m_ptr; }
@@ -127,13 +223,10 @@ public:
     void reset(T *ptr = nullptr)
     {
         if (ptr) {
-            ptr->m_refcount++;
+            ptr->add_ref();
         }
-        if (m_ptr) {
-            m_ptr->m_refcount--;
-            if (!m_ptr->m_refcount) {
-                m_ptr->last_unref();
-            }
+        if (m_ptr && m_ptr->drop_ref()) {
+            m_ptr->last_unref();
         }
         m_ptr = ptr;
     }
@@ -211,12 +304,26 @@ static inline bool operator!=(T *ptr, const refptr<T> &rp)
     return rp.operator!=(ptr);
 }
 
-/* Mix-in for a reference-counted type */
-template<typename T>
+/*
+ * Mix-in for a reference-counted type.
+ *
+ * Count is the type of the counter, e.g. uint8_t or uint16_t to save
+ * space in small objects. Overflow is caught by assert(). To pack a
+ * small counter next to the weakptr list head, inherit weak_target
+ * before refcounted; members of T can then use the remaining padding.
+ * (This does not carry over to the thread-safe variants, where
+ * weak_target_mt must be inherited after refcounted_mt; see
+ * weakptr_mt.)
+ */
+template<typename T, typename Count = unsigned>
 class refcounted
 {
 public:
     friend ref_base<T>;
+    friend ref_base<const T>;
+
+    static_assert(std::is_integral_v<Count> && std::is_unsigned_v<Count>,
+                  "Count must be an unsigned integer type");
 
     refcounted() {}
     ~refcounted()
@@ -232,26 +339,126 @@ public:
     refcounted(const refcounted &) = delete;
     refcounted &operator=(const refcounted &) = delete;
 
-    unsigned refcount() const { return m_refcount; }
+    Count refcount() const { return m_refcount; }
 
     // required to be defined in T:
     // void last_unref();
+    // void last_unref() const; (only if referenced by ref<const T>)
 
 private:
-    unsigned m_refcount = 0;
+    // mutable, since a const object can be referenced too
+    mutable Count m_refcount = 0;
+
+    void add_ref() const
+    {
+        assert(m_refcount != std::numeric_limits<Count>::max());
+        m_refcount++;
+    }
+
+    bool drop_ref() const { return !--m_refcount; } // true if last ref
+};
+
+/*
+ * Thread-safe variant of refcounted, using an atomic reference count.
+ * References to the same object can then be created and dropped from
+ * different threads (each individual ref/refptr is still only safe to
+ * use from one thread at a time, as with std::shared_ptr).
+ *
+ * Incrementing is relaxed, since a new reference can only be created
+ * from an existing one. Decrementing is acq_rel, so that last_unref()
+ * sees all accesses made through other (now dropped) references.
+ * Count is as for refcounted (but overflow is detected only after the
+ * fact, by the thread that caused it).
+ */
+template<typename T, typename Count = unsigned>
+class refcounted_mt
+{
+public:
+    friend ref_base<T>;
+    friend ref_base<const T>;
+    friend weakptr_mt<T>;
+
+    static_assert(std::is_integral_v<Count> && std::is_unsigned_v<Count>,
+                  "Count must be an unsigned integer type");
+
+    refcounted_mt() {}
+    ~refcounted_mt()
+    {
+        // make sure all references are gone
+        assert(refcount() == 0);
+    }
+
+    // not copyable/movable (see refcounted)
+    refcounted_mt(const refcounted_mt &) = delete;
+    refcounted_mt &operator=(const refcounted_mt &) = delete;
+
+    Count refcount() const
+    {
+        return m_refcount.load(std::memory_order_relaxed);
+    }
+
+    // required to be defined in T:
+    // void last_unref();
+    // void last_unref() const; (only if referenced by ref<const T>)
+
+private:
+    // mutable, since a const object can be referenced too
+    mutable std::atomic<Count> m_refcount = 0;
+
+    void add_ref() const
+    {
+        [[maybe_unused]] Count old =
+            m_refcount.fetch_add(1, std::memory_order_relaxed);
+        assert(old != std::numeric_limits<Count>::max());
+    }
+
+    bool drop_ref() const
+    {
+        return m_refcount.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    // increments only if non-zero (for weakptr_mt::lock())
+    bool try_add_ref() const
+    {
+        Count count = m_refcount.load(std::memory_order_relaxed);
+        while (count) {
+            assert(count != std::numeric_limits<Count>::max());
+            if (m_refcount.compare_exchange_weak(count, count + 1,
+                                                 std::memory_order_acquire,
+                                                 std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
 };
 
 /* Specialization where last_unref() does nothing */
-template<typename T>
-class ref_guarded : public refcounted<T>
+template<typename T, typename Count = unsigned>
+class ref_guarded : public refcounted<T, Count>
 {
 public:
     void last_unref() { /* no-op */ }
 };
 
 /* Specialization where last_unref() deletes the object */
-template<typename T>
-class ref_owned : public refcounted<T>
+template<typename T, typename Count = unsigned>
+class ref_owned : public refcounted<T, Count>
+{
+public:
+    void last_unref() { delete static_cast<T *>(this); }
+};
+
+/* Thread-safe variants of the above */
+template<typename T, typename Count = unsigned>
+class ref_guarded_mt : public refcounted_mt<T, Count>
+{
+public:
+    void last_unref() { /* no-op */ }
+};
+
+template<typename T, typename Count = unsigned>
+class ref_owned_mt : public refcounted_mt<T, Count>
 {
 public:
     void last_unref() { delete static_cast<T *>(this); }
@@ -262,6 +469,9 @@ public:
  *
  * Automatically resets to null when the pointed-to object is deleted.
  * The pointed-to type needs to inherit the "weak_target" mix-in.
+ *
+ * The weakptrs to an object form a doubly-linked list (headed in the
+ * object), so adding or removing a weakptr takes constant time.
  */
 template<typename T>
 class weakptr
@@ -271,15 +481,35 @@ public:
 
     weakptr() {}
     weakptr(const weakptr &wp) { reset(wp.m_ptr); }
-    // move constructor omitted (cannot be moved efficiently)
     ~weakptr() { reset(); }
 
+    // takes over the position of wp in the linked list
+    weakptr(weakptr &&wp) noexcept { take_over(wp); }
+
     explicit weakptr(T *ptr) { reset(ptr); }
     explicit weakptr(const refptr<T> &rp) { reset(rp.get()); }
 
+    // stays in the same place in the list if the target is unchanged
     weakptr &operator=(const weakptr &wp)
     {
-        return util::reconstruct(*this, wp);
+        if (wp.m_ptr != m_ptr) {
+            reset(wp.m_ptr);
+        }
+        return *this;
+    }
+
+    weakptr &operator=(weakptr &&wp)
+    {
+        if (&wp == this) {
+            return *this;
+        }
+        if (wp.m_ptr == m_ptr) {
+            wp.reset(); // already linked to the same target
+        } else {
+            reset();
+            take_over(wp);
+        }
+        return *this;
     }
 
     T *get() const { return m_ptr; }
@@ -300,29 +530,51 @@ public:
     {
         if (m_ptr) {
             // remove from linked list
-            if (m_ptr->m_weak_head == this) {
-                m_ptr->m_weak_head = this->next;
+            if (m_prev) {
+                m_prev->m_next = m_next;
             } else {
-                auto prior = m_ptr->m_weak_head;
-                while (prior->next != this) {
-                    prior = prior->next;
-                }
-                prior->next = this->next;
+                m_ptr->m_weak_head = m_next;
+            }
+            if (m_next) {
+                m_next->m_prev = m_prev;
             }
         }
         m_ptr = ptr;
+        m_prev = nullptr;
         if (ptr) {
-            // add to linked list
-            this->next = ptr->m_weak_head;
+            // add to head of linked list
+            m_next = ptr->m_weak_head;
+            if (m_next) {
+                m_next->m_prev = this;
+            }
             ptr->m_weak_head = this;
         } else {
-            this->next = nullptr;
+            m_next = nullptr;
         }
     }
 
 private:
     T *m_ptr = nullptr;
-    weakptr<T> *next = nullptr;
+    weakptr<T> *m_prev = nullptr;
+    weakptr<T> *m_next = nullptr;
+
+    // requires that this weakptr is not linked
+    void take_over(weakptr &wp)
+    {
+        m_ptr = wp.m_ptr;
+        m_prev = wp.m_prev;
+        m_next = wp.m_next;
+        if (m_prev) {
+            m_prev->m_next = this;
+        } else if (m_ptr) {
+            m_ptr->m_weak_head = this;
+        }
+        if (m_next) {
+            m_next->m_prev = this;
+        }
+        wp.m_ptr = nullptr;
+        wp.m_prev = wp.m_next = nullptr;
+    }
 };
 
 template<typename T>
@@ -395,6 +647,226 @@ public:
     }
 };
 
+/* Minimal spinlock, for the short critical sections in weakptr_mt */
+class ref_spinlock
+{
+public:
+    void lock()
+    {
+        while (m_locked.exchange(true, std::memory_order_acquire)) {
+            while (m_locked.load(std::memory_order_relaxed)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    bool try_lock()
+    {
+        return !m_locked.load(std::memory_order_relaxed) &&
+               !m_locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock() { m_locked.store(false, std::memory_order_release); }
+
+private:
+    std::atomic_bool m_locked = false;
+};
+
+/*
+ * Thread-safe intrusive weak pointer. The pointed-to type needs to
+ * inherit both "refcounted_mt" and "weak_target_mt", in that order (or
+ * "ref_owned_weak_mt", which does so). Unlike weakptr, the target
+ * cannot be accessed directly; lock() must be used to get a (strong)
+ * refptr, which is null once the refcount has dropped to zero.
+ *
+ * There is no global lock. Each target has a lock protecting its list
+ * of weakptrs, and each weakptr has a lock protecting its target
+ * pointer. A weakptr holds its own lock while taking the target's
+ * lock; the target's destructor takes its own lock first but only
+ * try-locks each weakptr (backing off on failure), so they cannot
+ * deadlock. While a weakptr is locked, the target cannot finish
+ * destruction, which is what makes lock() safe.
+ *
+ * The order of the base classes matters since lock() reads the
+ * refcount of a target that may be under destruction. Bases are
+ * destroyed in reverse order, so inheriting weak_target_mt second
+ * means every weakptr is reset before the refcount is destroyed. The
+ * order is checked by assert() (assuming that non-virtual bases are
+ * laid out in declaration order, as in the Itanium C++ ABI).
+ *
+ * As with refptr, each individual weakptr_mt should only be modified
+ * by one thread at a time, but different weakptr_mts to the same
+ * target can be used (and copied from) in parallel.
+ */
+template<typename T>
+class weakptr_mt
+{
+public:
+    friend weak_target_mt<T>;
+
+    weakptr_mt() {}
+    ~weakptr_mt() { reset(); }
+
+    explicit weakptr_mt(T *ptr) { reset(ptr); }
+    explicit weakptr_mt(const refptr<T> &rp) { reset(rp.get()); }
+
+    weakptr_mt(const weakptr_mt &wp)
+    {
+        // the target cannot be destroyed while wp is locked
+        wp.m_lock.lock();
+        if (wp.m_ptr) {
+            link(wp.m_ptr);
+        }
+        wp.m_lock.unlock();
+    }
+
+    weakptr_mt &operator=(const weakptr_mt &wp)
+    {
+        return util::reconstruct(*this, wp);
+    }
+
+    // returns null if the target is gone (or going)
+    refptr<T> lock() const
+    {
+        refptr<T> rp;
+        m_lock.lock();
+        if (m_ptr && m_ptr->try_add_ref()) {
+            // take over the reference added by try_add_ref()
+            static_cast<ref_base<T> &>(rp).m_ptr = m_ptr;
+        }
+        m_lock.unlock();
+        return rp;
+    }
+
+    // ptr (if not null) must be kept alive by the caller
+    void reset(T *ptr = nullptr)
+    {
+        m_lock.lock();
+        if (m_ptr) {
+            unlink();
+        }
+        if (ptr) {
+            link(ptr);
+        }
+        m_lock.unlock();
+    }
+
+private:
+    mutable ref_spinlock m_lock;
+    T *m_ptr = nullptr;
+    weakptr_mt<T> *m_prev = nullptr;
+    weakptr_mt<T> *m_next = nullptr;
+
+    // add to head of ptr's linked list
+    void link(T *ptr)
+    {
+        ptr->m_weak_lock.lock();
+        m_ptr = ptr;
+        m_prev = nullptr;
+        m_next = ptr->m_weak_head;
+        if (m_next) {
+            m_next->m_prev = this;
+        }
+        ptr->m_weak_head = this;
+        ptr->m_weak_lock.unlock();
+    }
+
+    void unlink()
+    {
+        T *ptr = m_ptr;
+        ptr->m_weak_lock.lock();
+        unlink_locked();
+        ptr->m_weak_lock.unlock();
+    }
+
+    // called with the target's lock held
+    void unlink_locked()
+    {
+        if (m_prev) {
+            m_prev->m_next = m_next;
+        } else {
+            m_ptr->m_weak_head = m_next;
+        }
+        if (m_next) {
+            m_next->m_prev = m_prev;
+        }
+        m_ptr = nullptr;
+        m_prev = m_next = nullptr;
+    }
+};
+
+/* Mix-in for a weakptr_mt target type (inherit after refcounted_mt) */
+template<typename T>
+class weak_target_mt
+{
+public:
+    friend weakptr_mt<T>;
+
+    weak_target_mt()
+    {
+        // refcounted_mt must be destroyed last (see weakptr_mt)
+        assert((uintptr_t)count_base(static_cast<T *>(this)) <
+               (uintptr_t)this);
+    }
+
+    ~weak_target_mt()
+    {
+        m_weak_lock.lock();
+        while (m_weak_head) {
+            auto wp = m_weak_head;
+            if (!wp->m_lock.try_lock()) {
+                // wp may be waiting for m_weak_lock, so let it proceed
+                m_weak_lock.unlock();
+                std::this_thread::yield();
+                m_weak_lock.lock();
+                continue;
+            }
+            wp->unlink_locked();
+            wp->m_lock.unlock();
+        }
+        m_weak_lock.unlock();
+    }
+
+    // not copyable/movable (see weak_target)
+    weak_target_mt(const weak_target_mt &) = delete;
+    weak_target_mt &operator=(const weak_target_mt &) = delete;
+
+private:
+    ref_spinlock m_weak_lock;
+    weakptr_mt<T> *m_weak_head = nullptr; // linked list
+
+    // the refcounted_mt base of T, whatever its Count
+    template<typename Count>
+    static const void *count_base(const refcounted_mt<T, Count> *base)
+    {
+        return base;
+    }
+};
+
+/* ref_owned_mt and weak_target_mt, inherited in the required order */
+template<typename T, typename Count = unsigned>
+class ref_owned_weak_mt : public ref_owned_mt<T, Count>,
+                          public weak_target_mt<T>
+{
+};
+
+/*
+ * refptr and ownptr (with a stateless deleter) are just a pointer, and
+ * moving one does not need to touch the target at all.
+ */
+namespace util
+{
+
+template<typename T>
+struct is_trivially_relocatable<refptr<T>> : std::true_type {
+};
+
+template<class T, void (*D)(std::remove_extent_t<T> *), class Del>
+struct is_trivially_relocatable<ownptr<T, D, Del>> : std::is_empty<Del> {
+};
+
+} // namespace util
+
 #define ASSERT_PTR(ptr, name)                                                  \
     auto name = (ptr).get();                                                   \
     assert(name)
@@ -0,0 +1,194 @@
+#include "accum_bufs.h"
+#include "lockfree_accum.h"
+#include <iostream>
+#include <thread>
+
+#define TEST(x) do {                    \
+    if (x) {                            \
+        std::cout << "PASS: " #x "\n";  \
+    } else {                            \
+        std::cout << "FAIL: " #x "\n";  \
+    }                                   \
+} while (0)
+
+static void test_counters()
+{
+    lfa_counter<> c;
+    for (uint64_t i = 1; i <= 100; i++) {
+        c.accum(i);
+    }
+    lfa_counter<> c2 = c;
+    c.merge(c2);
+    TEST(c.report() == 10100);
+
+    lfa_counter_vec<5> v, v2;
+    for (size_t i = 0; i < 50; i++) {
+        v.accum(i % 5);
+    }
+    v2.accum(4);
+    v.merge(v2);
+    v.merge(v2);
+    TEST(v[0] == 10 && v[3] == 10 && v[4] == 12);
+    TEST(v.report().total() == 52);
+
+    v.reset();
+    TEST(v.total() == 0);
+}
+
+static void test_histogram()
+{
+    using hist = lfa_histogram<100, 200, 10>;
+    TEST(hist::bucket_of(0) == 0 && hist::bucket_of(109) == 0);
+    TEST(hist::bucket_of(110) == 1 && hist::bucket_of(1000) == 9);
+
+    hist h;
+    for (uint64_t i = 100; i < 200; i++) {
+        h.accum(i);
+    }
+    TEST(h.total() == 100 && h[0] == 10 && h[9] == 10);
+    TEST(h.quantile(0) == 109 && h.quantile(0.5) == 149);
+    TEST(h.quantile(0.51) == 159 && h.quantile(1) == 199);
+
+    // odd bucket count exercises the scalar tail of the merge
+    lfa_histogram<0, 7, 7> a, b;
+    for (uint64_t i = 0; i < 7; i++) {
+        a.accum(i);
+        b.accum(6);
+    }
+    a.merge(b);
+    TEST(a[0] == 1 && a[5] == 1 && a[6] == 8 && a.total() == 14);
+    TEST(a.sum() == 63 && a.mean() == 4.5);
+}
+
+static void test_log_histogram()
+{
+    using hist = lfa_log_histogram<3, 40>;
+    TEST(hist::buckets == 304);
+
+    // bucket bounds are contiguous and increasing
+    bool ok = true;
+    for (size_t i = 0; i < hist::buckets; i++) {
+        uint64_t lo = hist::bucket_min(i), hi = hist::bucket_max(i);
+        ok = ok && hist::bucket_of(lo) == i && hist::bucket_of(hi) == i;
+        ok = ok && (i == 0 || lo == hist::bucket_max(i - 1) + 1);
+        ok = ok && (i < 8 || hi - lo + 1 <= lo / 8);
+    }
+    TEST(ok);
+    TEST(hist::bucket_of(UINT64_MAX) == hist::buckets - 1);
+
+    using full = lfa_log_histogram<4, 64>;
+    TEST(full::bucket_of(UINT64_MAX) == full::buckets - 1);
+    TEST(full::bucket_max(full::buckets - 1) == UINT64_MAX);
+
+    hist h;
+    for (uint64_t i = 1; i <= 1000; i++) {
+        h.accum(i * 1000);
+    }
+    uint64_t p50 = h.quantile(0.5), p99 = h.quantile(0.99);
+    TEST(p50 >= 500000 && p50 < 500000 * 9 / 8);
+    TEST(p99 >= 990000 && p99 < 990000 * 9 / 8);
+    TEST(h.quantile(1) >= 1000000 && h.sum() == 500500000);
+}
+
+static void test_topk()
+{
+    lfa_topk<32, 4> t;
+    uint64_t seed = 1;
+    for (int i = 0; i < 100000; i++) {
+        uint64_t key;
+        if (i % 4 == 0) {
+            key = 1000 + (i / 4) % 3; // 3 heavy keys, 1/12 each
+        } else {
+            seed = seed * 6364136223846793005 + 1442695040888963407;
+            key = seed >> 40; // noise
+        }
+        t.accum(key);
+    }
+
+    lfa_topk_entry top[3];
+    size_t n = t.top(top, 3);
+    bool heavy = (n == 3);
+    for (size_t i = 0; i < n; i++) {
+        heavy = heavy && top[i].key >= 1000 && top[i].key < 1003;
+        // the true count is within [count - error, count]
+        uint64_t lo = top[i].count - top[i].error;
+        heavy = heavy && lo <= 8334 && top[i].count >= 8333;
+    }
+    TEST(heavy);
+    TEST(n == 3 && top[0].count >= top[1].count &&
+         top[1].count >= top[2].count);
+    TEST(t.total() == 100000);
+
+    // merging doubles the heavy counts
+    lfa_topk<32, 4> t2 = t;
+    t2.merge(t);
+    lfa_topk_entry top2[1];
+    TEST(t2.top(top2, 1) == 1 && top2[0].count == top[0].count * 2);
+    TEST(t2.total() == 200000);
+
+    t2.reset();
+    TEST(t2.top(top2, 1) == 0 && t2.total() == 0);
+}
+
+/* the buffers plugged into the accumulators */
+static void test_accum()
+{
+    static_assert(std::is_trivially_copyable_v<lfa_log_histogram<>>);
+    static_assert(std::is_trivially_copyable_v<lfa_topk<>>);
+
+    lockfree_accum<lfa_log_histogram<>, uint64_t> lfa;
+    std::thread worker([&]() {
+        for (uint64_t i = 0; i < 100000; i++) {
+            lfa.accum(i % 1000);
+        }
+        lfa.flush();
+    });
+
+    uint64_t total = 0;
+    while (total < 100000) {
+        const lfa_log_histogram<> *h = lfa.report();
+        if (h) {
+            total += h->total();
+            lfa.reset();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    worker.join();
+    TEST(total == 100000);
+
+    sharded_accum<lfa_counter_vec<4>, size_t, 4> sa;
+    std::thread workers[2];
+    for (auto &w : workers) {
+        w = std::thread([&]() {
+            auto p = sa.get_producer();
+            for (size_t i = 0; i < 10000; i++) {
+                p.accum(i % 4);
+            }
+        });
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+
+    const lfa_counter_vec<4> *v = sa.report();
+    TEST(v && (*v)[0] == 5000 && (*v)[3] == 5000);
+    sa.reset();
+
+    seqlock_accum<lfa_histogram<0, 100, 10>, uint64_t> sl;
+    for (uint64_t i = 0; i < 100; i++) {
+        sl.accum(i);
+    }
+    auto snap = sl.snapshot();
+    TEST(snap.report().total() == 100 && snap[9] == 10);
+}
+
+int main(void)
+{
+    test_counters();
+    test_histogram();
+    test_log_histogram();
+    test_topk();
+    test_accum();
+    return 0;
+}
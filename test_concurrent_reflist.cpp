@@ -0,0 +1,135 @@
+/* See concurrent_reflist.h for copyright & license */
+#include "concurrent_reflist.h"
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TEST(x) do {                    \
+    if (x) {                            \
+        std::cout << "PASS: " #x "\n";  \
+    } else {                            \
+        std::cout << "FAIL: " #x "\n";  \
+    }                                   \
+} while (0)
+
+struct item : public ref_owned_mt<item> {
+    static inline std::atomic<int> live = 0;
+    std::string val;
+
+    item(const std::string &val) : val(val) { live++; }
+    ~item() { live--; }
+};
+
+std::string to_str(concurrent_reflist<item> &list)
+{
+    std::string str;
+    for (auto &i : list) {
+        str += i.val;
+    }
+    return str;
+}
+
+int main(void)
+{
+    {
+        concurrent_reflist<item> list;
+        refptr<item> a{new item("a")};
+
+        list.append(a);
+        list.append(new item("b"));
+        list.prepend(new item("1"));
+
+        TEST(to_str(list) == "1ab");
+        TEST(list.size() == 3 && list.contains(a));
+
+        // same iterator rules as reflist
+        std::string str;
+        for (auto it = list.begin(); it; ++it) {
+            str += it->val;
+            if (it->val == "1") {
+                list.remove(a);
+                list.append(new item("c"));
+            }
+            if (it->val == "b") {
+                list.remove(it.get());
+                TEST(it->val == "b"); // still valid
+            }
+        }
+
+        TEST(str == "1b");
+        TEST(to_str(list) == "1c");
+        TEST(list.size() == 2 && !list.contains(a));
+
+        a = refptr<item>();
+        list.reclaim();
+        list.reclaim();
+        TEST(item::live == 2);
+
+        list.clear();
+        TEST(list.empty() && to_str(list) == "");
+
+        // alternating ends (each regrow keeps the other end's headroom)
+        std::string expect;
+        for (int i = 0; i < 200; i++) {
+            std::string val(1, 'a' + i % 26);
+            if (i & 1) {
+                list.append(new item(val));
+                expect += val;
+            } else {
+                list.prepend(new item(val));
+                expect = val + expect;
+            }
+        }
+        TEST(to_str(list) == expect && list.size() == 200);
+        list.clear();
+    }
+    TEST(item::live == 0);
+
+    // readers iterating while another thread modifies the list
+    {
+        concurrent_reflist<item> list;
+        std::atomic<bool> done = false;
+        std::atomic<int> bad = 0;
+
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 3; t++) {
+            readers.emplace_back([&]() {
+                while (!done) {
+                    for (auto &i : list) {
+                        if (i.val != "x") {
+                            bad++;
+                        }
+                    }
+                }
+            });
+        }
+
+        std::vector<refptr<item>> added;
+        for (int i = 0; i < 5000; i++) {
+            refptr<item> p{new item("x")};
+            (i & 1) ? list.append(p) : list.prepend(p);
+            added.push_back(std::move(p));
+            if (i % 3 == 2) {
+                list.remove(added[i / 2]);
+                list.remove(added[i - 1]);
+            }
+        }
+
+        done = true;
+        for (auto &t : readers) {
+            t.join();
+        }
+
+        int size = list.size();
+        added.clear();
+        list.reclaim();
+        list.reclaim();
+
+        TEST(bad == 0);
+        TEST(item::live == size);
+    }
+    TEST(item::live == 0);
+
+    return 0;
+}
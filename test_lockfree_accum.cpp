@@ -1,9 +1,18 @@
 #include "lockfree_accum.h"
 #include <iostream>
+#include <memory>
 #include <string>
 #include <thread>
 #include <unistd.h>
 
+#define TEST(x) do {                    \
+    if (x) {                            \
+        std::cout << "PASS: " #x "\n";  \
+    } else {                            \
+        std::cout << "FAIL: " #x "\n";  \
+    }                                   \
+} while (0)
+
 class test_buf
 {
 public:
@@ -47,8 +56,397 @@ private:
     std::string data;
 };
 
+/* a value accumulated while both buffers are empty must be reported */
+static void test_first_accum()
+{
+    lockfree_accum<test_buf, std::string> lfa;
+    lfa.accum("a");
+    const std::string *r = lfa.report();
+    TEST(r && *r == "a");
+    lfa.reset();
+
+    lfa.accum("b");
+    r = lfa.report();
+    TEST(r && *r == "b");
+    lfa.reset();
+}
+
+class sum_buf
+{
+public:
+    static inline std::atomic_int copies = 0;
+
+    sum_buf() {}
+    sum_buf(const sum_buf &other) : sum(other.sum) { copies++; }
+
+    sum_buf &operator=(const sum_buf &other)
+    {
+        sum = other.sum;
+        copies++;
+        return *this;
+    }
+
+    void accum(const long &val) { sum += val; }
+
+    template<class It>
+    void accum_range(It first, It last)
+    {
+        for (; first != last; ++first) {
+            sum += *first;
+        }
+    }
+
+    void merge(const sum_buf &other) { sum += other.sum; }
+    const long &report() { return sum; }
+    void reset() { sum = 0; }
+
+private:
+    long sum = 0;
+};
+
+/* Counts values, sleeping for each value's number of microseconds */
+class slow_buf
+{
+public:
+    static inline std::atomic_bool sleeping = false;
+
+    void accum(const long &us)
+    {
+        sleeping = true;
+        usleep(us);
+        sleeping = false;
+        count++;
+    }
+
+    const long &report() { return count; }
+    void reset() { count = 0; }
+
+private:
+    long count = 0;
+};
+
+/* Keeps two copies of the sum to detect torn/unordered buffer access */
+class check_buf
+{
+public:
+    static inline std::atomic_int errors = 0;
+
+    void accum(const long &val)
+    {
+        sum += val;
+        check += val;
+    }
+
+    void merge(const check_buf &other)
+    {
+        sum += other.sum;
+        check += other.check;
+    }
+
+    const long &report()
+    {
+        if (sum != check) {
+            errors++;
+        }
+        return sum;
+    }
+
+    void reset() { sum = check = 0; }
+
+private:
+    long sum = 0, check = 0;
+};
+
+static void test_sharded()
+{
+    sharded_accum<sum_buf, long, 8> sa;
+    std::atomic_int running = 4;
+    std::thread workers[4];
+
+    for (auto &w : workers) {
+        w = std::thread([&]() {
+            auto p = sa.get_producer();
+            for (int i = 1; i <= 100000; i++) {
+                p.accum(i);
+            }
+            running--;
+        });
+    }
+
+    long total = 0;
+    for (bool done = false; !done;) {
+        done = (running == 0); // one more report after workers finish
+        const long *r = sa.report();
+        if (r) {
+            total += *r;
+            sa.reset();
+        }
+    }
+
+    for (auto &w : workers) {
+        w.join();
+    }
+
+    TEST(total == 4 * (100000L * 100001 / 2));
+    TEST(!sa.report());
+}
+
+static void test_batch()
+{
+    lockfree_accum<sum_buf, long> lfa;
+    std::atomic_bool running = true;
+
+    std::thread worker([&]() {
+        long batch[100];
+        for (int i = 0; i < 1000; i++) {
+            for (int j = 0; j < 100; j++) {
+                batch[j] = i * 100 + j + 1;
+            }
+            lfa.accum_batch(batch, batch + 100);
+        }
+        running = false;
+    });
+
+    long total = 0;
+    for (bool done = false; !done;) {
+        done = !running;
+        const long *r = lfa.report();
+        if (r) {
+            total += *r;
+            lfa.reset();
+        }
+    }
+
+    worker.join();
+    TEST(total == 100000L * 100001 / 2);
+}
+
+/* Accumulates 1..count from a worker thread, returns sum of reports */
+template<class LFA>
+static long sum_accum(LFA &lfa, int count, int *reports = nullptr)
+{
+    std::atomic_bool running = true;
+
+    std::thread worker([&]() {
+        for (int i = 1; i <= count; i++) {
+            lfa.accum(i);
+        }
+        lfa.flush();
+        running = false;
+    });
+
+    long total = 0;
+    for (bool done = false; !done;) {
+        done = !running;
+        const long *r = lfa.report();
+        if (reports) {
+            (*reports)++;
+        }
+        if (r) {
+            total += *r;
+            lfa.reset();
+        }
+    }
+
+    worker.join();
+    return total;
+}
+
+static void test_delta()
+{
+    lockfree_accum<sum_buf, long, LFA_DELTA> lfa;
+    int reports = 0;
+
+    sum_buf::copies = 0;
+    TEST(sum_accum(lfa, 100000, &reports) == 100000L * 100001 / 2);
+    TEST(sum_buf::copies <= reports + 1);
+}
+
+static void test_isolate()
+{
+    using lfa_t = lockfree_accum<sum_buf, long, LFA_ISOLATE>;
+    using lfa_delta_t = lockfree_accum<sum_buf, long, LFA_ISOLATE | LFA_DELTA>;
+
+    TEST(alignof(lfa_t) == LFA_CACHE_LINE);
+    TEST(sizeof(lfa_t) == 3 * LFA_CACHE_LINE);
+    TEST(sizeof(lfa_delta_t) == 4 * LFA_CACHE_LINE);
+
+    auto lfa = std::make_unique<lfa_delta_t>();
+    TEST(sum_accum(*lfa, 100000) == 100000L * 100001 / 2);
+}
+
+template<unsigned Flags>
+static void test_stress()
+{
+    lockfree_accum<check_buf, long, Flags> lfa;
+    const int count = 2000000;
+
+    check_buf::errors = 0;
+    TEST(sum_accum(lfa, count) == (long)count * (count + 1) / 2);
+    TEST(check_buf::errors == 0);
+}
+
+static void test_stats()
+{
+    lockfree_accum<sum_buf, long, LFA_STATS> lfa;
+    int reports = 0;
+
+    TEST(sum_accum(lfa, 100000, &reports) == 100000L * 100001 / 2);
+
+    lockfree_accum_stats st = lfa.stats();
+    TEST(st.direct + st.copy + st.fresh == 100000);
+    TEST(st.discard <= st.fresh);
+    TEST(st.report_hit + st.report_miss == (uint64_t)reports);
+}
+
+static void test_seqlock()
+{
+    seqlock_accum<check_buf, long> sla;
+    std::atomic_bool running = true;
+    std::atomic_int regressions = 0;
+    std::thread readers[3];
+
+    check_buf::errors = 0;
+
+    for (auto &r : readers) {
+        r = std::thread([&]() {
+            long last = 0;
+            while (running) {
+                check_buf snap = sla.snapshot();
+                long sum = snap.report(); // checks consistency
+                if (sum < last) {
+                    regressions++;
+                }
+                last = sum;
+            }
+        });
+    }
+
+    for (int i = 1; i <= 1000000; i++) {
+        sla.accum(i);
+    }
+
+    running = false;
+    for (auto &r : readers) {
+        r.join();
+    }
+
+    TEST(sla.snapshot().report() == 1000000L * 1000001 / 2);
+    TEST(check_buf::errors == 0);
+    TEST(regressions == 0);
+
+    sla.clear();
+    TEST(sla.snapshot().report() == 0);
+}
+
+/* 64 KiB, so that a copy takes much longer than an accum() */
+class big_buf
+{
+public:
+    void accum(const long &val)
+    {
+        counts[val % 8192]++;
+        total++;
+    }
+
+    const long &report() { return total; }
+    void reset() { *this = big_buf(); }
+
+    bool consistent() const
+    {
+        long sum = 0;
+        for (long count : counts) {
+            sum += count;
+        }
+        return sum == total;
+    }
+
+private:
+    long counts[8192] = {};
+    long total = 0;
+};
+
+/* try_snapshot() gives up instead of starving behind a hot writer */
+static void test_seqlock_bounded()
+{
+    seqlock_accum<big_buf, long> sla;
+    std::atomic_bool running = true;
+    long written = 0;
+
+    std::thread writer([&]() {
+        for (; running; written++) {
+            sla.accum(written);
+        }
+    });
+
+    auto snap = std::make_unique<big_buf>();
+    int hits = 0, torn = 0;
+    for (int i = 0; i < 1000; i++) {
+        if (sla.try_snapshot(*snap, 4)) {
+            hits++;
+            torn += !snap->consistent();
+        }
+    }
+
+    running = false;
+    writer.join();
+
+    std::cout << "Bounded snapshots: " << hits << "/1000\n";
+    TEST(torn == 0);
+    TEST(sla.try_snapshot(*snap, 1) && snap->report() == written);
+}
+
+template<unsigned Flags>
+static void test_wait()
+{
+    using namespace std::chrono;
+    lockfree_accum<sum_buf, long, Flags> lfa;
+
+    auto start = steady_clock::now();
+    TEST(!lfa.report_wait(milliseconds(20)));
+    TEST(steady_clock::now() - start >= milliseconds(20));
+
+    std::thread worker([&]() {
+        usleep(50000);
+        lfa.accum(42);
+    });
+
+    start = steady_clock::now();
+    const long *r = lfa.report_wait(seconds(10));
+    TEST(r && *r == 42);
+    TEST(steady_clock::now() - start < seconds(5));
+    lfa.reset();
+
+    worker.join();
+
+    /*
+     * A reset() while accum() adds to the valid buffer next to the one
+     * being reported leaves no valid buffer until that accum() ends.
+     */
+    lockfree_accum<slow_buf, long, Flags> slow;
+    slow.accum(0);
+    TEST(slow.report());
+    slow.accum(0); // REPORT_VALID
+
+    std::thread direct([&]() { slow.accum(100000); });
+    while (!slow_buf::sleeping) {
+        std::this_thread::yield();
+    }
+    slow.reset(); // EMPTY_ACCUM
+
+    start = steady_clock::now();
+    r = slow.report_wait(seconds(10));
+    TEST(r && *r == 2);
+    TEST(steady_clock::now() - start < seconds(5));
+    slow.reset();
+
+    direct.join();
+}
+
 int main(void)
 {
+    test_first_accum();
+
     lockfree_accum<test_buf, std::string> lfa;
 
     std::thread worker([&]() {
@@ -58,16 +456,29 @@ int main(void)
     });
 
     for (int i = 0; i < 16; i++) {
-        const std::string *r = lfa.report();
+        const std::string *r = lfa.report_wait(std::chrono::milliseconds(75));
         if (r) {
             std::cout << "Report #" << i << ": " << *r << "\n";
             lfa.reset();
         } else {
             std::cout << "Report #" << i << " is empty\n";
-            usleep(75000);
         }
     }
 
     worker.join();
+
+    test_sharded();
+    test_batch();
+    test_delta();
+    test_isolate();
+    test_stats();
+    test_seqlock();
+    test_seqlock_bounded();
+    test_wait<0>();
+    test_wait<LFA_RELAXED>();
+    test_stress<0>();
+    test_stress<LFA_RELAXED>();
+    test_stress<LFA_RELAXED | LFA_DELTA>();
+    test_stress<LFA_RELAXED | LFA_ISOLATE>();
     return 0;
 }
@@ -0,0 +1,94 @@
+/* See pool.h for copyright & license */
+#include "pool.h"
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TEST(x) do {                    \
+    if (x) {                            \
+        std::cout << "PASS: " #x "\n";  \
+    } else {                            \
+        std::cout << "FAIL: " #x "\n";  \
+    }                                   \
+} while (0)
+
+struct msg : public ref_pooled<msg> {
+    static inline int live = 0;
+    std::string val;
+
+    msg(const std::string &val) : val(val) { live++; }
+    ~msg() { live--; }
+};
+
+struct msg_mt : public ref_pooled_mt<msg_mt> {
+    long payload[4]{};
+};
+
+// small refcount (and a size class of its own)
+struct tiny : public ref_pooled<tiny, size_class_pool, uint16_t> {
+    char data[200];
+};
+
+// pooled types can only be created by make_ref_in()
+template<class T, class = void>
+struct can_new : std::false_type {
+};
+
+template<class T>
+struct can_new<T, std::void_t<decltype(new T)>> : std::true_type {
+};
+
+static_assert(!can_new<msg_mt>::value && !can_new<tiny>::value);
+
+int main(void)
+{
+    void *first;
+    {
+        auto m = make_ref_in<msg>("hello");
+        first = m.get();
+        TEST(m->val == "hello" && msg::live == 1);
+    }
+    TEST(msg::live == 0);
+
+    // block is reused from the thread cache
+    auto m2 = make_ref_in<msg>("again");
+    TEST((void *)m2.get() == first);
+
+    std::vector<refptr<msg>> msgs;
+    for (int i = 0; i < 1000; i++) {
+        msgs.emplace_back(make_ref_in<msg>(std::to_string(i)));
+    }
+    TEST(msg::live == 1001);
+    msgs.clear();
+    TEST(msg::live == 1);
+
+    // objects released on a different thread than allocated
+    std::vector<refptr<msg_mt>> objs;
+    for (int i = 0; i < 1000; i++) {
+        objs.emplace_back(make_ref_in<msg_mt>());
+    }
+
+    std::thread worker([&]() {
+        objs.clear();
+        for (int i = 0; i < 1000; i++) {
+            auto m = make_ref_in<msg_mt>();
+        }
+    });
+    worker.join();
+
+    TEST(objs.empty());
+
+    auto t = make_ref_in<tiny>();
+    TEST(t->refcount() == 1 && sizeof(t->refcount()) == 2);
+
+    // a cold thread cache is filled with a whole batch
+    std::thread cold([&]() {
+        auto t = make_ref_in<tiny>();
+        TEST(size_class_pool<tiny>::cached() ==
+             size_class_pool<tiny>::BATCH - 1);
+    });
+    cold.join();
+
+    return 0;
+}
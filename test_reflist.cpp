@@ -1,7 +1,12 @@
 /* See reflist.h for copyright & license */
 #include "reflist.h"
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #define TEST(x) do {                    \
     if (x) {                            \
@@ -18,7 +23,24 @@ struct test : public ref_owned<test> {
     ~test() { std::cout << "destroy: " << val << "\n"; }
 };
 
-std::string to_str(reflist<test> &list)
+struct num : public ref_owned<num> {
+    int val;
+
+    num(int val) : val(val) {}
+};
+
+struct listener : public ref_owned<listener> {
+    static int live;
+    int val;
+
+    listener(int val) : val(val) { live++; }
+    ~listener() { live--; }
+};
+
+int listener::live = 0;
+
+template<typename L>
+std::string to_str(L &list)
 {
     std::string str;
     for (auto &t : list) {
@@ -36,6 +58,24 @@ std::string to_str_rev(reflist<test> &list)
     return str;
 }
 
+std::string to_str_const(const reflist<test> &list)
+{
+    std::string str;
+    for (auto &t : list) {
+        str += t.val;
+    }
+    return str;
+}
+
+std::string to_str_snapshot(const reflist<test> &list)
+{
+    std::string str;
+    for (auto &t : list.snapshot()) {
+        str += t.val;
+    }
+    return str;
+}
+
 int main(void)
 {
     reflist<test> list, list2;
@@ -84,5 +124,251 @@ int main(void)
     TEST(list.remove(a));
     TEST(to_str(list) == "bc123");
 
+    // read-only traversals (including with nulls present)
+    {
+        auto it = list.begin();
+        ++it;
+        it.remove();
+        TEST(to_str_const(list) == "b123");
+        TEST(to_str_snapshot(list) == "b123");
+        TEST(list.cbegin().get() == list.begin().get());
+    }
+
+    // a list which is really const (iterating it must not change it)
+    {
+        const reflist<test> frozen(list);
+        TEST(to_str_const(frozen) == "b123");
+        TEST(to_str_snapshot(frozen) == "b123");
+        TEST(frozen.contains(frozen.begin().get()) && !frozen.contains(a));
+        TEST(frozen.refcount() == 0);
+    }
+
+    // compaction of many scattered (and some adjacent) nulls
+    reflist<num> nums;
+    for (int i = 0; i < 1000; i++) {
+        nums.append(new num(i));
+        nums.prepend(new num(-1 - i));
+    }
+
+    for (auto it = nums.begin(); it; ++it) {
+        if (it->val % 3 == 0 || (it->val > 100 && it->val < 200)) {
+            it.remove();
+        }
+    }
+
+    bool ordered = true;
+    int prev = INT_MIN;
+    for (auto &n : nums) {
+        ordered = ordered && n.val > prev && n.val % 3 != 0 &&
+                  !(n.val > 100 && n.val < 200);
+        prev = n.val;
+    }
+
+    TEST(ordered);
+    TEST(nums.size() == 1267);
+
+    // size is kept up to date while iterators (and nulls) exist
+    auto first = nums.begin();
+    first.remove();
+    TEST(nums.size() == 1266);
+    TEST(!first.remove());
+    TEST(nums.size() == 1266);
+
+    reflist<num> none;
+    none.append(refptr<num>());
+    TEST(none.empty() && none.size() == 0);
+
+    // removal of the current item (and others) during for_each_fast()
+    reflist<listener> listeners;
+    for (int i = 0; i < 10; i++) {
+        listeners.append(new listener(i));
+    }
+
+    int visited = 0;
+    bool alive = true;
+    listeners.for_each_fast([&](listener &l) {
+        visited++;
+        if (l.val % 2 == 0) {
+            listeners.remove(&l);
+            alive = alive && l.val % 2 == 0 && listener::live > 0;
+            listeners.append(new listener(l.val + 1001)); // not visited
+        }
+        if (l.val == 3) {
+            int nested = 0;
+            listeners.for_each_fast([&](listener &) { nested++; });
+            TEST(nested == 10); // 0 and 2 removed, 1001 and 1003 added
+        }
+    });
+
+    TEST(visited == 10);
+    TEST(alive);
+    TEST(listener::live == 10);
+    TEST(listeners.size() == 10);
+
+    refptr<test> x{new test("x")}, y{new test("y")}, z{new test("z")};
+
+    // bulk loading
+    {
+        reflist<test> bulk, more;
+        std::vector<refptr<test>> items{a, x, y};
+        bulk.reserve(10, 10);
+        bulk.append_range(items.begin(), items.end());
+        bulk.prepend_range(items.rbegin(), items.rend());
+        TEST(to_str(bulk) == "yxaaxy" && bulk.size() == 6);
+
+        more.append(z);
+        more.append_all(std::move(bulk));
+        TEST(to_str(more) == "zyxaaxy" && bulk.empty());
+        bulk.append_all(std::move(more));
+        TEST(to_str(bulk) == "zyxaaxy" && more.empty());
+
+        // taking another list's storage keeps each list's policy
+        reflist<test> target, source;
+        source.set_compaction(0.5, 10);
+        source.append(x);
+        target.append_all(std::move(source));
+        TEST(to_str(target) == "x" && source.empty());
+        TEST(target.compaction_ratio() == 0 &&
+             target.compaction_chunk() == 0);
+        TEST(source.compaction_ratio() == 0.5f &&
+             source.compaction_chunk() == 10);
+    }
+
+    // address searches (forward ones scan the slots directly)
+    {
+        num *mid = nullptr, *last = nullptr;
+        for (auto &n : nums) {
+            if (n.val == 500) {
+                mid = &n;
+            }
+            last = &n;
+        }
+
+        TEST(util::find_ptr(nums.begin(), mid).get() == mid);
+        TEST(util::find_ptr(nums.cbegin(), mid).get() == mid);
+        TEST(util::find_ptr(nums.rbegin(), mid).get() == mid);
+        TEST(!util::find_ptr(nums.begin(), (num *)nullptr));
+        num other(0);
+        TEST(!util::find_ptr(nums.begin(), &other));
+        TEST(util::next_after(nums.begin(), mid, false)->val == 502);
+        TEST(util::next_after(nums.begin(), last, true).get() ==
+             nums.begin().get());
+        TEST(!util::next_after(nums.begin(), last, false));
+    }
+
+    // chunked compaction, interleaved with iteration
+    {
+        indexed_reflist<num> chunked;
+        chunked.set_compaction(0.25, 100);
+        for (int i = 0; i < 1000; i++) {
+            chunked.append(new num(i));
+        }
+
+        int sum = 0;
+        for (int round = 0; round < 10; round++) {
+            for (auto it = chunked.begin(); it; ++it) {
+                if (it->val % 10 == round) {
+                    it.remove();
+                }
+            }
+            chunked.prepend(new num(-1 - round));
+        }
+        for (auto &n : chunked.snapshot()) {
+            sum += n.val;
+        }
+
+        TEST(chunked.size() == 10 && sum == -55);
+        chunked.compact();
+        TEST(chunked.contains(chunked.begin().get()));
+        TEST(chunked.remove(chunked.begin().get()));
+        TEST(chunked.size() == 9);
+    }
+
+    // parallel iteration, with tasks run on separate threads
+    {
+        std::vector<std::thread> pool;
+        auto exec = [&](std::function<void()> task) {
+            pool.emplace_back(std::move(task));
+        };
+
+        std::atomic<long> total = 0;
+        std::atomic<int> visits = 0;
+        nums.parallel_for_each(exec, [&](num &n) {
+            total += n.val;
+            visits++;
+        }, 64);
+
+        long expect = 0;
+        for (auto &n : nums) {
+            expect += n.val;
+        }
+
+        TEST(visits == nums.size() && total == expect);
+        TEST(!pool.empty());
+        for (auto &t : pool) {
+            t.join();
+        }
+    }
+
+    // a throwing func, on the calling thread or in a task
+    for (bool inline_only : {true, false}) {
+        std::vector<std::thread> pool;
+        auto exec = [&](std::function<void()> task) {
+            if (!inline_only) {
+                pool.emplace_back(std::move(task));
+            } // else dropped: the calling thread claims every chunk
+        };
+
+        std::atomic<int> visits = 0;
+        bool caught = false;
+        unsigned pins = nums.refcount();
+        try {
+            nums.parallel_for_each(exec, [&](num &) {
+                if (visits++ == 100) {
+                    throw std::runtime_error("bad item");
+                }
+            }, 64);
+        } catch (const std::runtime_error &e) {
+            caught = (std::string(e.what()) == "bad item");
+        }
+
+        TEST(caught && visits < nums.size());
+        TEST(nums.refcount() == pins);
+        for (auto &t : pool) {
+            t.join();
+        }
+    }
+
+    // indexed removal and middle insertion
+    indexed_reflist<test> index;
+    index.append(y);
+    index.prepend(x);
+    index.append(z);
+
+    TEST(index.contains(y) && !index.contains(a));
+    TEST(index.insert_before(y, new test("-")));
+    TEST(index.insert_before(x, new test("<")));
+    TEST(index.insert_before(z, new test("+")));
+    TEST(!index.insert_before(a, x));
+    TEST(to_str(index) == "<x-y+z");
+
+    TEST(index.remove(y));
+    TEST(!index.remove(y) && !index.contains(y));
+    TEST(index.remove(x) && index.remove(z));
+    TEST(to_str(index) == "<-+");
+    test *front = index.begin().get();
+    TEST(index.insert_before(front, z));
+    TEST(to_str(index) == "z<-+" && index.size() == 4);
+
+    // order-agnostic and single removal helpers (util.h)
+    std::vector<int> ints{1, 2, 3, 2, 5, 2, 7};
+    util::remove_unordered(ints, 2);
+    std::sort(ints.begin(), ints.end());
+    TEST(ints == std::vector<int>({1, 3, 5, 7}));
+    util::remove_if_unordered(ints, [](int i) { return i > 4; });
+    TEST(ints.size() == 2 && ints[0] + ints[1] == 4);
+    TEST(util::erase_first(ints, 3) && ints == std::vector<int>({1}));
+    TEST(!util::erase_first(ints, 3));
+
     return 0;
 }
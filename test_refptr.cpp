@@ -2,6 +2,8 @@
 #include "refptr.h"
 #include <iostream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #define TEST(x) do {                    \
     if (x) {                            \
@@ -18,6 +20,268 @@ struct test : public ref_owned<test>, public weak_target<test> {
     ~test() { std::cout << "destroy: " << val << "\n"; }
 };
 
+struct test_mt : public ref_owned_mt<test_mt> {
+    static inline std::atomic_int destroyed = 0;
+    ~test_mt() { destroyed++; }
+};
+
+static void test_refcounted_mt()
+{
+    refptr<test_mt> obj{new test_mt};
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([obj]() {
+            for (int j = 0; j < 100000; j++) {
+                refptr<test_mt> copy = obj;
+                copy.reset();
+            }
+        });
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    test_mt *ptr;
+    TEST(obj.check(ptr) && ptr->refcount() == 1);
+    TEST(test_mt::destroyed == 0);
+    obj.reset();
+    TEST(test_mt::destroyed == 1);
+}
+
+static void test_weak_vector()
+{
+    refptr obj{new test("weak_vector")};
+    std::vector<weakptr<test>> weaks;
+
+    // moves (rather than copies) on reallocation
+    for (int i = 0; i < 1000; i++) {
+        weaks.emplace_back(obj);
+    }
+
+    int valid = 0;
+    for (auto &w : weaks) {
+        valid += (w == obj);
+    }
+    TEST(valid == 1000);
+
+    // unlink every other weakptr
+    for (int i = 0; i < 1000; i += 2) {
+        weaks[i].reset();
+    }
+
+    weakptr<test> moved = std::move(weaks[1]);
+    TEST(!weaks[1] && moved == obj);
+
+    // assignment between different and same targets, and to self
+    refptr other{new test("weak_vector_other")};
+    weakptr<test> to_other(other);
+    to_other = std::move(weaks[3]);
+    TEST(!weaks[3] && to_other == obj);
+    weaks[3] = weaks[5];
+    weaks[5] = std::move(weaks[3]);
+    TEST(!weaks[3] && weaks[5] == obj);
+    auto &self = weaks[5];
+    weaks[5] = self;
+    weaks[5] = std::move(self);
+    TEST(weaks[5] == obj);
+    weaks[7] = weakptr<test>(other);
+    other.reset();
+    TEST(!weaks[7]);
+
+    obj.reset();
+    valid = 0;
+    for (auto &w : weaks) {
+        valid += (bool)w;
+    }
+    TEST(valid == 0 && !moved);
+}
+
+struct session : public ref_owned_mt<session>,
+                 public weak_target_mt<session> {
+    static inline std::atomic_int destroyed = 0;
+    ~session() { destroyed++; }
+};
+
+static void test_weakptr_mt()
+{
+    refptr<session> obj{new session};
+    weakptr_mt<session> weak(obj);
+
+    auto locked = weak.lock();
+    session *ptr;
+    TEST(locked == obj && obj.check(ptr) && ptr->refcount() == 2);
+    locked.reset();
+
+    std::atomic_int running = 0;
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([&]() {
+            running++;
+            while (true) {
+                weakptr_mt<session> copy = weak;
+                refptr<session> rp = copy.lock();
+                if (!rp) {
+                    break;
+                }
+            }
+        });
+    }
+
+    while (running < 4) {
+        std::this_thread::yield();
+    }
+
+    obj.reset(); // threads exit once lock() fails
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    TEST(session::destroyed == 1);
+    TEST(!weak.lock());
+
+    // combined base, with a small count
+    struct job : public ref_owned_weak_mt<job, uint16_t> {
+    };
+    refptr<job> j{new job};
+    weakptr_mt<job> weak_job(j);
+    job *jp;
+    TEST(weak_job.lock() == j && j.check(jp) && jp->refcount() == 2);
+    j.reset();
+    TEST(!weak_job.lock());
+}
+
+static int freed = 0;
+
+static void free_int(int *p)
+{
+    freed += *p;
+    delete p;
+}
+
+// a stateful deleter, for a list whose links own the next node
+struct chain;
+struct chain_delete {
+    int *deleted = nullptr;
+    void operator()(chain *node) const;
+};
+
+struct chain {
+    int val = 0;
+    ownptr_with<chain, chain_delete> next;
+};
+
+void chain_delete::operator()(chain *node) const
+{
+    (*deleted)++;
+    delete node;
+}
+
+static void test_ownptr()
+{
+    struct arena_obj {
+        int val;
+    };
+    arena_obj arena[2] = {{1}, {2}};
+
+    ownptr<test> plain;
+    plain.set_new("ownptr");
+    TEST(plain && plain.get()->val == "ownptr");
+    test *raw = plain.get();
+    TEST(raw == plain);
+
+    ownptr<int, free_int> with_fn;
+    with_fn.set_new(5);
+
+    ownptr_with<arena_obj, own_nodelete> from_arena(&arena[0]);
+    from_arena.reset(&arena[1]);
+    TEST(from_arena.get()->val == 2);
+
+    ownptr<int[]> array;
+    array.set_new(16);
+    array[15] = 42;
+    TEST(array[0] == 0 && array[15] == 42);
+
+    TEST(sizeof(plain) == sizeof(test *));
+    TEST(sizeof(with_fn) == sizeof(int *));
+    TEST(sizeof(from_arena) == sizeof(arena_obj *));
+    TEST(sizeof(array) == sizeof(int *));
+
+    with_fn.reset();
+    TEST(freed == 5);
+
+    // the source is a member of the object being replaced
+    int deleted = 0;
+    ownptr_with<chain, chain_delete> head(new chain{1}, {&deleted});
+    head.get()->next = ownptr_with<chain, chain_delete>(new chain{2},
+                                                        {&deleted});
+    head = std::move(head.get()->next);
+    TEST(deleted == 1 && head.get()->val == 2 && !head.get()->next);
+    head.reset();
+    TEST(deleted == 2);
+}
+
+// weak list head first, then the small count and T's members
+struct small_node : public weak_target<small_node>,
+                    public ref_owned<small_node, uint16_t> {
+    uint16_t kind = 0;
+    uint32_t val = 0;
+};
+
+struct wide_node : public weak_target<wide_node>,
+                   public ref_owned<wide_node> {
+    uint16_t kind = 0;
+    uint32_t val = 0;
+};
+
+static void test_small_count()
+{
+    TEST(sizeof(small_node) == 16 && sizeof(wide_node) == 24);
+
+    struct tiny : public ref_guarded<tiny, uint8_t> {
+    } obj;
+    refptr<tiny> first(&obj);
+    std::vector<refptr<tiny>> refs(254, first); // the maximum
+    TEST(obj.refcount() == 255);
+    refs.clear();
+    first.reset();
+    TEST(obj.refcount() == 0);
+
+    refptr<small_node> node{new small_node};
+    weakptr<small_node> weak(node);
+    node.reset();
+    TEST(!weak);
+
+    struct tiny_mt : public ref_guarded_mt<tiny_mt, uint8_t> {
+    } obj_mt;
+    refptr<tiny_mt> ref_mt(&obj_mt), ref_mt2 = ref_mt;
+    TEST(obj_mt.refcount() == 2);
+}
+
+// referenced only as const (last_unref() is then const too)
+struct frozen : public refcounted<frozen, uint8_t> {
+    mutable int released = 0;
+    void last_unref() const { released++; }
+};
+
+struct frozen_mt : public refcounted_mt<frozen_mt, uint8_t> {
+    mutable int released = 0;
+    void last_unref() const { released++; }
+};
+
+template<class Frozen>
+static void test_const_ref()
+{
+    const Frozen obj;
+    refptr<const Frozen> ref1(&obj), ref2 = ref1;
+    TEST(obj.refcount() == 2);
+    ref1.reset();
+    ref2.reset();
+    TEST(obj.refcount() == 0 && obj.released == 1);
+}
+
 int main(void)
 {
     refptr test1{new test("test1")};
@@ -50,6 +314,11 @@ int main(void)
     TEST(test1b.check(ptr1) && ptr1->refcount() == 2);
     TEST(test2b.check(ptr2) && ptr2->refcount() == 1);
 
+    auto &self = test2;
+    test2 = self;
+    test2 = std::move(self);
+    TEST(test2 == test1b && ptr1->refcount() == 2);
+
     w2 = w1;
 
     TEST(w1 && w1b && w2 && w2b);
@@ -60,5 +329,13 @@ int main(void)
     test2b.reset();
     TEST(!w1 && !w1b && !w2 && !w2b);
 
+    test_ownptr();
+    test_refcounted_mt();
+    test_weak_vector();
+    test_weakptr_mt();
+    test_small_count();
+    test_const_ref<frozen>();
+    test_const_ref<frozen_mt>();
+
     return 0;
 }
@@ -19,7 +19,15 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <algorithm>
+#include <type_traits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace util
 {
@@ -54,13 +62,73 @@ void remove_if(L &list, F &&func)
                list.end());
 }
 
-/* Find-by-address for reflist (not fully generic) */
+/*
+ * Like remove_if(), but doesn't preserve order: each removed element
+ * is replaced by one moved from the end, so only as many elements are
+ * moved as are removed.
+ */
+template<typename L, typename F>
+void remove_if_unordered(L &list, F &&func)
+{
+    auto it = list.begin(), end = list.end();
+    while (it != end) {
+        if (func(*it)) {
+            if (it != --end) {
+                *it = std::move(*end); // and check again
+            }
+        } else {
+            ++it;
+        }
+    }
+    list.erase(end, list.end());
+}
+
+/* Like remove(), but doesn't preserve order (see remove_if_unordered) */
+template<typename L, typename V>
+void remove_unordered(L &list, const V &val)
+{
+    remove_if_unordered(list, [&](const auto &item) { return item == val; });
+}
+
+/* Erases only the first element equal to val; returns false if none */
+template<typename L, typename V>
+bool erase_first(L &list, const V &val)
+{
+    auto it = find(list, val);
+    if (it == list.end()) {
+        return false;
+    }
+    list.erase(it);
+    return true;
+}
+
+template<typename It, typename = void>
+struct has_seek_ptr : std::false_type {
+};
+
+template<typename It>
+struct has_seek_ptr<It, std::void_t<decltype(std::declval<It &>().seek_ptr(
+                            (const void *)nullptr))>> : std::true_type {
+};
+
+/*
+ * Find-by-address for reflist (not fully generic). Iterators that can
+ * search their underlying storage directly provide seek_ptr().
+ */
 template<typename It, typename P>
 auto find_ptr(It start, const P &ptr)
 {
-    for (; start; ++start) {
-        if (start.get() == ptr) {
-            break;
+    if constexpr (has_seek_ptr<It>::value) {
+        if constexpr (std::is_convertible_v<const P &, const void *>) {
+            start.seek_ptr(ptr);
+        } else {
+            start.seek_ptr(ptr.get());
+        }
+    } else {
+        for (; start; ++start) {
+            if (start.get() == ptr) {
+                break;
+            }
         }
     }
     return start;
@@ -95,6 +163,74 @@ auto next_after_if(It start, It stop, const P &ptr, bool wrap, const F &func)
     return next;
 }
 
+/*
+ * Whether T can be moved to a new address by memcpy (leaving the old
+ * copy unused, without running its destructor). True for trivially
+ * copyable types; smart pointers specialize it in refptr.h.
+ */
+template<typename T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {
+};
+
+/*
+ * Returns the index of the first element in items[start, n) equal to
+ * ptr (or n if not found). Compares two pointers per SSE2 instruction
+ * where available.
+ */
+static inline size_t find_raw_ptr(void *const *items, size_t start, size_t n,
+                                  const void *ptr)
+{
+    size_t i = start;
+#if defined(__SSE2__) && UINTPTR_MAX == UINT64_MAX
+    // equal 64-bit lanes have both 32-bit halves equal
+    __m128i val = _mm_set1_epi64x((long long)(uintptr_t)ptr);
+    for (; i + 4 <= n; i += 4) {
+        auto a = _mm_loadu_si128((const __m128i *)(items + i));
+        auto b = _mm_loadu_si128((const __m128i *)(items + i + 2));
+        int ma = _mm_movemask_epi8(_mm_cmpeq_epi32(a, val));
+        int mb = _mm_movemask_epi8(_mm_cmpeq_epi32(b, val));
+        if (!(ma | mb)) {
+            continue; // common case: no match
+        }
+        int mask = ma | (mb << 16);
+        for (int lane = 0; lane < 4; lane++) {
+            if (((mask >> (lane * 8)) & 0xff) == 0xff) {
+                return i + lane;
+            }
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (items[i] == ptr) {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Removes null pointers from an array (preserving order) and returns
+ * the new length. Runs of non-null pointers are found with
+ * find_raw_ptr() and moved with memmove. The vacated slots at the end
+ * are zeroed.
+ */
+static inline size_t compact_nulls(void **items, size_t n)
+{
+    size_t out = find_raw_ptr(items, 0, n, nullptr);
+    size_t in = out;
+    while (in < n) {
+        while (in < n && !items[in]) {
+            in++;
+        }
+        size_t run_end = find_raw_ptr(items, in, n, nullptr);
+        memmove(items + out, items + in, (run_end - in) * sizeof(void *));
+        out += run_end - in;
+        in = run_end;
+    }
+    memset((void *)(items + out), 0, (n - out) * sizeof(void *));
+    return out;
+}
+
 /* Generic implementation of operator=() using constructor */
 template<typename T, typename V>
 T &reconstruct(T &self, V &&val)